@@ -0,0 +1,2107 @@
+#include <time.h>
+#include <math.h>
+#include <complex.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "engine.h"
+
+#define N ENGINE_N
+
+#ifndef PI
+#define PI 3.14159265358979323846f
+#endif
+
+// Alignment of every buffer handed out by the engine arena, one cache line
+#define ARENA_ALIGN 64
+#define ARENA_SIZE(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Largest Q15 component allowed going into a radix-2 stage. A butterfly can
+// grow a component by up to (1 + sqrt(2)), so anything above this gets the
+// whole block shifted down by one first.
+#define Q15_HEADROOM 13000
+
+// Constant-Q layout: bins per octave, lowest center frequency, relative
+// threshold below which spectral kernel values are dropped
+#define CQ_BPO 48
+#define CQ_FMIN 27.5f
+#define CQ_THRESHOLD 0.005f
+
+// Multirate chain: the full rate level plus a cascade of half-band
+// decimators, each level analyzed with the same short FFT. The last level
+// has the bin spacing of a full rate N point FFT.
+#define MR_LEVELS 5
+#define MR_N (N >> (MR_LEVELS - 1))
+#define HB_TAPS 63
+
+// Multi-resolution STFT: FFT size per band and the first bin (of the N point
+// layout) each band is responsible for. Long windows for the lows, short
+// ones for the highs.
+#define MS_BANDS 3
+
+// Most worker threads a pool starts. Pools get one worker per CPU besides
+// the calling thread, which runs jobs too.
+#define POOL_MAX_THREADS 15
+
+// Transforms of at least this size go through the cache blocked four-step
+// FFT. Below it the whole working set fits in cache anyway, so at the
+// default ENGINE_N only engine_benchmark runs it.
+#define FOURSTEP_MIN (1 << 16)
+#define FOURSTEP_BLOCK 32
+#define FOURSTEP_JOBS 16
+
+// Display bands of the linear bin modes: the lowest ones are single FFT
+// bins 1..BAND_LINEAR (which the sliding DFT tracks), the rest grow
+// geometrically up to nyquist. BAND_STEP is the growth of the default
+// layout, used until a band count is asked for.
+#define BAND_LINEAR 100
+#define BAND_STEP 1.01f
+
+// Frames of history the tap keeps per channel. More than one window, so the
+// analysis can use a window that ends before the newest sample.
+#define TAP_RING (4 * N)
+
+// Frames past the newest sample that reads of the ring keep clear of, for
+// the block engine_push may be writing meanwhile. Device blocks are far
+// shorter.
+#define TAP_GUARD N
+
+typedef struct
+{
+    float complex in_rawL[N];  // Raw data from audio stream buffer
+    float complex out_rawL[N]; // Spectrum, bins 0..N/2 (also the packed transform buffer)
+    float out_logL[N];
+
+    float complex in_rawR[N];  // Raw data from audio stream buffer
+    float complex out_rawR[N];
+    float out_logR[N];
+
+    Spectrum_Snapshot snap[2]; // Two most recent analysis frames
+    int snapHead;              // Index of the newest one in snap
+} FFT_Analyzer;
+
+// Fixed-point analysis state for targets without a fast FPU. The window is
+// quantized to Q15 from the same float window the other modes use and
+// transformed with a block-floating-point FFT that packs both channels into
+// a single complex transform.
+typedef struct
+{
+    int16_t hann[N];            // Q15 hann window
+    int16_t twRe[N / 2];        // Q15 twiddles exp(-2*pi*i*k/N)
+    int16_t twIm[N / 2];
+    uint16_t rev[N];            // Bit reversal permutation
+    int32_t log2Lut[33];        // Q16 log2(1 + i/32)
+
+    int16_t re[N];              // Transform buffer, L in re and R in im
+    int16_t im[N];
+    uint32_t magL[N / 2];       // Squared magnitude per bin, scaled by 2^(2*exp)
+    uint32_t magR[N / 2];
+    int32_t logL[N / 2];        // Q16 log10(1 + m) per display bin
+    int32_t logR[N / 2];
+} FFT_Q15;
+
+// Constant-Q spectral kernels (Brown & Puckette). Each bin's kernel is the
+// conjugate FFT of a hann windowed complex exponential whose length gives a
+// fixed Q. After thresholding every kernel is a short run of contiguous FFT
+// bins, so a frame is one small dot product per constant-Q bin.
+typedef struct
+{
+    int binsPerOctave;
+    float fmin;
+    unsigned int sampleRate;
+
+    size_t bins;                // Number of constant-Q bins
+    int *first;                 // First FFT bin of each kernel
+    int *count;                 // Number of FFT bins in each kernel
+    size_t *offset;             // Start of each kernel in val
+    float complex *val;         // Kernel values, packed
+    size_t nnz;
+} CQ_Kernel;
+
+// One polyphase half-band decimator. Only every other input produces an
+// output and only the odd taps (plus the center) are non-zero.
+typedef struct
+{
+    float histL[2 * HB_TAPS];   // Input history, mirrored so the newest
+    float histR[2 * HB_TAPS];   // HB_TAPS samples are always contiguous
+    int pos;
+    int phase;
+} HalfBand;
+
+typedef struct
+{
+    float hb[HB_TAPS];                  // Half-band prototype, unity DC gain
+    float hann[MR_N];
+
+    HalfBand stage[MR_LEVELS - 1];      // Stage d feeds level d + 1
+    float ringL[MR_LEVELS][MR_N];       // Per level sample rings, circular
+    float ringR[MR_LEVELS][MR_N];
+    size_t head[MR_LEVELS];
+
+    float complex in[MR_N];             // Transform buffer
+    float magL[MR_LEVELS][MR_N / 2];
+    float magR[MR_LEVELS][MR_N / 2];
+} Multirate;
+
+typedef struct
+{
+    float hann[MS_BANDS][N];
+    float complex buf[MS_BANDS][N];     // Both channels packed, L + iR
+    float magL[MS_BANDS][N / 2];
+    float magR[MS_BANDS][N / 2];
+} MultiRes;
+
+// Modulated sliding DFT (mSDFT) for a handful of low bins of the N point
+// layout, updated per sample in the audio tap. Each accumulator is kept in
+// absolute-time phase, so every update uses an exact table twiddle and no
+// rotation error builds up. The hann window is applied on readout from the
+// neighbouring bins.
+typedef struct
+{
+    int count;                              // Requested bins
+    int bin[SDFT_MAX_BINS];                 // FFT bin of each request
+    int idx[SDFT_MAX_BINS][3];              // Tracked slots of bin - 1, bin, bin + 1
+
+    int rawCount;                           // Tracked bins, requests plus neighbours
+    int raw[3 * SDFT_MAX_BINS];
+    double complex yL[3 * SDFT_MAX_BINS];
+    double complex yR[3 * SDFT_MAX_BINS];
+    size_t n;                               // Sample index mod N
+} SDFT;
+
+// Four-step (six-step with explicit transposes) FFT of n = n1 * n2 points.
+// Every pass is either a blocked transpose or a batch of contiguous short
+// transforms that fit in L1, so no pass walks the full array with a large
+// stride. Passes are split into row ranges and run on the worker pool.
+typedef struct
+{
+    int n;
+    int n1;                     // Rows of the input matrix, length of the first FFTs
+    int n2;                     // Columns, length of the second FFTs
+    float complex *tw;          // W_n^(j2 * k1), laid out as n2 rows of n1
+    float complex *tmp;
+    float complex *x;           // Transform in progress
+    const float complex *twiddle; // N point table for the row transforms
+    int pass;
+} FFT_Plan;
+
+// Small persistent worker pool. pool_run hands out jobs 0..count-1 to the
+// workers and the calling thread alike and returns once all of them finished.
+typedef struct
+{
+    pthread_t threads[POOL_MAX_THREADS];
+    int threadCount;            // Workers actually running, 0 runs every job on the caller
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    Pool_Job fn;
+    void *ctx;
+    int count;
+    int next;
+    int finished;
+    unsigned int batch;
+    bool quit;
+} Worker_Pool;
+
+// Per-channel history of everything the tap delivered, deinterleaved from
+// the incoming frames. Two of the channels feed the (stereo) analysis and
+// display. Frame p of the stream (counted from the first push) sits at
+// p & (TAP_RING - 1) for as long as it is kept.
+typedef struct
+{
+    unsigned int channels;      // Interleaved channels per incoming frame
+    unsigned int pair[2];       // Channels shown as left and right
+    size_t head;                // Next write position, the oldest sample (engine_push only)
+    float ring[TAP_MAX_CHANNELS][TAP_RING];
+} Tap;
+
+
+// One block holding every fixed size buffer of an engine, carved up at
+// creation and released as a whole
+typedef struct
+{
+    void *block;                // As returned by malloc
+    unsigned char *base;        // First ARENA_ALIGN aligned byte of block
+    size_t used;
+    size_t cap;
+} Arena;
+
+struct Engine
+{
+    Arena arena;
+
+    Tap *tap;
+    FFT_Analyzer *fft;
+    FFT_Q15 *fftq;
+    CQ_Kernel *cq;              // Built on first use, heap allocated (size depends on the rate)
+    Multirate *mr;
+    MultiRes *ms;
+    SDFT *sdft;
+    Worker_Pool *pool;
+    FFT_Plan *bigPlan;          // Only for N >= FOURSTEP_MIN, heap allocated
+    float complex *twiddle;     // exp(-2*pi*i*k/N), shared by every power of two transform up to N
+    float *hann;                // N point analysis window
+
+    // Display band layout of the FFT, multirate and multi-resolution modes:
+    // band s covers FFT bins bandEdge[s] up to bandEdge[s + 1]. Rebuilt only
+    // when the requested band count changes.
+    uint32_t *bandEdge;         // N / 2 + 1 entries
+    size_t bandCount;
+    size_t bandTarget;          // As requested, 0 for the BAND_STEP layout
+
+    Analysis_Mode analysisMode;
+
+    // Sample rate of the pushed frames
+    unsigned int tapRate;
+
+    // Extra delay (seconds) applied to the playing position, positive
+    // moves the visuals later
+    double syncOffset;
+
+    bool useQ15;
+
+    // Total number of frames pushed so far. Bumped by engine_push (on the
+    // audio thread); consumers compare it against the last value they saw
+    // to decide whether anything needs to be analyzed or redrawn.
+    atomic_size_t tapGen;
+
+    // Wall time and size of the newest pushed block, and the time audio
+    // spends between the tap and the speakers (0 to estimate it)
+    _Atomic double tapTime;
+    atomic_uint tapBlock;
+    double outLatency;
+};
+
+static const int msSize[MS_BANDS] = { N, N / 4, N / 16 };
+static const size_t msFirst[MS_BANDS] = { 0, N / 32, N / 8 };
+
+static bool arena_init(Arena *a, size_t cap);
+static void *arena_alloc(Arena *a, size_t size);
+static void arena_free(Arena *a);
+static void band_layout(Engine *e, size_t bands);
+static void tap_deinterleave(Engine *e, const float *src, size_t frames);
+static void tap_linearize(Engine *e, size_t end);
+static void _fft(float complex in[], float complex out[], int n, int step);
+static void fft_transform(Engine *e);
+static float fast_log10(float x);
+static void spectrum_log_normalize(float *restrict outL, float *restrict outR, size_t s, float max2L, float max2R);
+static size_t fft_process(Engine *e);
+static void cqt_init(Engine *e, int binsPerOctave, float fmin, unsigned int sampleRate);
+static double complex cqt_geosum(double a, int len);
+static void cqt_free(Engine *e);
+static size_t cqt_process(Engine *e);
+static void mr_init(Engine *e);
+static void mr_reset(Engine *e);
+static void mr_push(Engine *e, int level, float l, float r);
+static size_t mr_process(Engine *e);
+static int pool_cpus();
+static void pool_init(Worker_Pool *pool);
+static void pool_free(Worker_Pool *pool);
+static void pool_take(Worker_Pool *pool, unsigned int batch);
+static void *pool_worker(void *arg);
+static void pool_run(Worker_Pool *pool, Pool_Job fn, void *ctx, int count);
+static void fft_radix2(const float complex *tw, float complex *x, int n);
+static FFT_Plan *fft_plan_create(int n);
+static void fft_plan_free(FFT_Plan *p);
+static void fft_transpose(const float complex *src, float complex *dst, int rows, int cols, int r0, int r1);
+static void fft_fourstep_job(void *ctx, int job);
+static void fft_fourstep(Engine *e, FFT_Plan *p, float complex *x, bool threaded);
+static void fft_bench_large(Engine *e);
+static void twiddle_init(Engine *e);
+static float complex twiddle_full(Engine *e, size_t j);
+static void sdft_init(Engine *e, const int *bins, int count);
+static void sdft_reset(Engine *e);
+static void sdft_push(Engine *e, float l, float r, float oldL, float oldR);
+static size_t sdft_log(Engine *e, float *outL, float *outR);
+static void ms_init(Engine *e);
+static void ms_band(void *ctx, int b);
+static size_t ms_process(Engine *e);
+static size_t spectrum_analyze(Engine *e, size_t end);
+static void fftq_init(Engine *e);
+static int fftq_transform(Engine *e);
+static int32_t fftq_log2(Engine *e, uint32_t x);
+static uint32_t fftq_isqrt(uint32_t x);
+static size_t fftq_process(Engine *e);
+static void spectrum_push(Engine *e, size_t bins, double t, size_t lag);
+
+Engine *engine_create(const Engine_Config *cfg)
+{
+    Engine *e = (Engine *)malloc(sizeof(Engine));
+    memset(e, 0, sizeof(Engine));
+
+    size_t cap = ARENA_SIZE(sizeof(Tap)) + ARENA_SIZE(sizeof(FFT_Analyzer)) + ARENA_SIZE(sizeof(FFT_Q15))
+               + ARENA_SIZE(sizeof(Multirate)) + ARENA_SIZE(sizeof(MultiRes)) + ARENA_SIZE(sizeof(SDFT))
+               + ARENA_SIZE(sizeof(Worker_Pool)) + ARENA_SIZE((N / 2) * sizeof(float complex))
+               + ARENA_SIZE((N / 2 + 1) * sizeof(uint32_t)) + ARENA_SIZE(N * sizeof(float));
+
+    if (!arena_init(&e->arena, cap)) {
+        printf("ERROR: Could not allocate %zu bytes for the engine\n", cap);
+        free(e);
+        return NULL;
+    }
+
+    e->tap = arena_alloc(&e->arena, sizeof(Tap));
+    e->fft = arena_alloc(&e->arena, sizeof(FFT_Analyzer));
+    e->fftq = arena_alloc(&e->arena, sizeof(FFT_Q15));
+    e->mr = arena_alloc(&e->arena, sizeof(Multirate));
+    e->ms = arena_alloc(&e->arena, sizeof(MultiRes));
+    e->sdft = arena_alloc(&e->arena, sizeof(SDFT));
+    e->pool = arena_alloc(&e->arena, sizeof(Worker_Pool));
+    e->twiddle = arena_alloc(&e->arena, (N / 2) * sizeof(float complex));
+    e->bandEdge = arena_alloc(&e->arena, (N / 2 + 1) * sizeof(uint32_t));
+    e->hann = arena_alloc(&e->arena, N * sizeof(float));
+
+    e->analysisMode = ANALYSIS_FFT;
+    e->tapRate = (cfg != NULL && cfg->sampleRate > 0) ? cfg->sampleRate : 48000;
+    e->useQ15 = (cfg != NULL) ? cfg->useQ15 : false;
+    atomic_init(&e->tapGen, 0);
+    atomic_init(&e->tapTime, 0.0);
+    atomic_init(&e->tapBlock, 0);
+
+    engine_set_channels(e, (cfg != NULL && cfg->channels > 0) ? cfg->channels : 2);
+    engine_set_bands(e, 0);
+    if (e->tap->channels == 0) {
+        arena_free(&e->arena);
+        free(e);
+        return NULL;
+    }
+
+    twiddle_init(e);
+    fftq_init(e);
+    mr_init(e);
+    ms_init(e);
+    pool_init(e->pool);
+
+#if N >= FOURSTEP_MIN
+    e->bigPlan = fft_plan_create(N);
+#endif
+
+    if (cfg != NULL && cfg->lowBins != NULL)
+        sdft_init(e, cfg->lowBins, cfg->lowBinCount);
+
+    return e;
+}
+
+void engine_free(Engine *e)
+{
+    if (e == NULL) return;
+
+    pool_free(e->pool);
+    fft_plan_free(e->bigPlan);
+    cqt_free(e);
+    arena_free(&e->arena);
+    free(e);
+}
+
+size_t engine_generation(const Engine *e)
+{
+    return atomic_load(&e->tapGen);
+}
+
+void engine_set_rate(Engine *e, unsigned int sampleRate)
+{
+    // The constant-Q kernels are rebuilt for the new rate on next use
+    e->tapRate = sampleRate;
+}
+
+unsigned int engine_rate(const Engine *e)
+{
+    return e->tapRate;
+}
+
+void engine_set_output_latency(Engine *e, double seconds)
+{
+    e->outLatency = seconds;
+}
+
+double engine_output_latency(const Engine *e)
+{
+    // Without a figure from the consumer assume the device double buffers:
+    // a block pushed now plays after the one already queued, which is about
+    // as long as the blocks the tap gets
+    if (e->outLatency > 0.0) return e->outLatency;
+
+    return (double)atomic_load(&e->tapBlock) / e->tapRate;
+}
+
+void engine_set_mode(Engine *e, Analysis_Mode mode)
+{
+    // engine_push feeds the multirate chain only while it is selected, so
+    // it starts from silence rather than from whatever it held when last
+    // used. Must not run while engine_push can be called.
+    if (mode == ANALYSIS_MULTIRATE && e->analysisMode != mode)
+        mr_reset(e);
+
+    e->analysisMode = mode;
+}
+
+Analysis_Mode engine_mode(const Engine *e)
+{
+    return e->analysisMode;
+}
+
+size_t engine_analyze(Engine *e, double t)
+{
+    // Window ending at the newest sample
+    size_t bins = spectrum_analyze(e, atomic_load(&e->tapGen));
+    spectrum_push(e, bins, t, 0);
+    return bins;
+}
+
+size_t engine_analyze_at(Engine *e, double t, size_t center)
+{
+    // Window centered on the given stream position, as far as the tap has
+    // samples past it and still keeps the ones before it. The multirate
+    // and sliding DFT state only exists for the newest samples.
+    size_t newest = atomic_load(&e->tapGen);
+    size_t lag = (center + N / 2 < newest) ? newest - (center + N / 2) : 0;
+    if (lag > TAP_RING - TAP_GUARD - N) lag = TAP_RING - TAP_GUARD - N;
+
+    size_t bins = spectrum_analyze(e, newest - lag);
+    spectrum_push(e, bins, t, lag);
+    return bins;
+}
+
+void engine_set_bands(Engine *e, size_t bands)
+{
+    // Display bands of the linear bin modes, typically one per pixel column
+    // the spectrum is drawn across; 0 goes back to the BAND_STEP layout.
+    // The layout is only rebuilt when the count actually changes.
+    if (bands != 0 && bands < BAND_LINEAR + 1) bands = BAND_LINEAR + 1;
+    if (bands > N / 2 - 1) bands = N / 2 - 1;
+    if (bands == e->bandTarget && e->bandCount > 0) return;
+
+    e->bandTarget = bands;
+    band_layout(e, bands);
+}
+
+size_t engine_band_of(const Engine *e, size_t bin)
+{
+    // Band of the current layout holding the given FFT bin
+    size_t lo = 0;
+    size_t hi = e->bandCount;
+
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (e->bandEdge[mid] <= bin) lo = mid;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+size_t engine_position(const Engine *e)
+{
+    return atomic_load(&e->tapGen);
+}
+
+size_t engine_playing(const Engine *e, double now)
+{
+    // Inverse of the snapshot heard time model: frame k of the newest block
+    // (pushed at tapTime) plays at tapTime + latency + k / rate. The sync
+    // offset holds the visuals back by that much more.
+    size_t newest = atomic_load(&e->tapGen);
+    double block = atomic_load(&e->tapBlock);
+    double since = now - atomic_load(&e->tapTime) - engine_output_latency(e) - e->syncOffset;
+    double pos = (double)newest - block + since * e->tapRate;
+
+    if (pos < 0.0) return 0;
+    if (pos > (double)newest) return newest;
+    return (size_t)pos;
+}
+
+void engine_set_sync_offset(Engine *e, double seconds)
+{
+    e->syncOffset = seconds;
+}
+
+double engine_sync_offset(const Engine *e)
+{
+    return e->syncOffset;
+}
+
+const Spectrum_Snapshot *engine_snapshot(const Engine *e, int age)
+{
+    // 0 is the newest snapshot, 1 the one before it
+    return &e->fft->snap[e->fft->snapHead ^ (age & 1)];
+}
+
+size_t engine_low_bins(Engine *e, float *outL, float *outR)
+{
+    return sdft_log(e, outL, outR);
+}
+
+void engine_wave(const Engine *e, size_t end, float *left, float *right, size_t n)
+{
+    // n samples of the displayed pair up to stream position end (clamped to
+    // what the tap has), oldest first
+    const float *l = e->tap->ring[e->tap->pair[0]];
+    const float *r = e->tap->ring[e->tap->pair[1]];
+    size_t newest = atomic_load(&e->tapGen);
+
+    if (end > newest) end = newest;
+    if (newest - end > TAP_RING - TAP_GUARD - n) end = newest - (TAP_RING - TAP_GUARD - n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t j = (end - n + i) & (TAP_RING - 1);
+        left[i] = l[j];
+        right[i] = r[j];
+    }
+}
+
+void engine_ring(const float *mag, size_t count, float low, float rest, float cx, float cy, float radius, float *xy)
+{
+    // Closed polar outline: count (x, y) pairs, magnitudes below low sit at
+    // rest, and the last point repeats the first
+    if (count == 0) return;
+
+    for (size_t i = 0; i < count - 1; i++)
+    {
+        float angle = (2.0f * PI * i) / count;
+        float val = (mag[i] < low) ? rest : mag[i];
+
+        xy[2 * i] = cx + radius * val * cosf(angle);
+        xy[2 * i + 1] = cy + radius * val * sinf(angle);
+    }
+
+    xy[2 * (count - 1)] = xy[0];
+    xy[2 * (count - 1) + 1] = xy[1];
+}
+
+void engine_pool_run(Engine *e, Pool_Job fn, void *ctx, int count)
+{
+    pool_run(e->pool, fn, ctx, count);
+}
+
+void engine_push(Engine *e, const float *fs, unsigned int frames)
+{
+    // Interleaved float frames of tap->channels channels, on their way to
+    // the device as of now
+    double now = wall_time();
+    unsigned int ch = e->tap->channels;
+    unsigned int pl = e->tap->pair[0];
+    unsigned int pr = e->tap->pair[1];
+
+    for (size_t i = 0; i < frames; i++)
+    {
+        // The sample leaving the window is the one about to be overwritten
+        // (or one from this same block, if it is longer than the window)
+        float oldL = (i < N) ? e->tap->ring[pl][(e->tap->head - N + i) & (TAP_RING - 1)] : fs[(i - N) * ch + pl];
+        float oldR = (i < N) ? e->tap->ring[pr][(e->tap->head - N + i) & (TAP_RING - 1)] : fs[(i - N) * ch + pr];
+
+        sdft_push(e, fs[i * ch + pl], fs[i * ch + pr], oldL, oldR);
+    }
+
+    tap_deinterleave(e, fs, frames);
+
+    if (e->analysisMode == ANALYSIS_MULTIRATE)
+    {
+        for (size_t i = 0; i < frames; i++)
+            mr_push(e, 0, fs[i * ch + pl], fs[i * ch + pr]);
+    }
+
+    atomic_store(&e->tapTime, now);
+    atomic_store(&e->tapBlock, frames);
+    atomic_fetch_add(&e->tapGen, frames);
+}
+
+void engine_set_channels(Engine *e, unsigned int channels)
+{
+    if (channels == 0 || channels > TAP_MAX_CHANNELS) {
+        printf("ERROR: %u channels, the tap keeps at most %d\n", channels, TAP_MAX_CHANNELS);
+        return;
+    }
+
+    e->tap->channels = channels;
+    e->tap->pair[0] = 0;
+    e->tap->pair[1] = (channels > 1) ? 1 : 0;
+}
+
+void engine_cycle_pair(Engine *e)
+{
+    // 0/1, 2/3, ... with a lone last channel shown on both sides. The
+    // running sliding DFT only knows the old pair, so start from silence.
+    // Must not run while engine_push can be called.
+    unsigned int next = e->tap->pair[0] + 2;
+    if (next >= e->tap->channels) next = 0;
+
+    engine_reset(e);
+    e->tap->pair[0] = next;
+    e->tap->pair[1] = (next + 1 < e->tap->channels) ? next + 1 : next;
+
+    printf("INFO: Showing channels %u and %u of %u\n", e->tap->pair[0], e->tap->pair[1], e->tap->channels);
+}
+
+void engine_reset(Engine *e)
+{
+    // Back to silence. Must not run while engine_push can be called.
+    memset(e->fft, 0, sizeof(*e->fft));
+    // The head stays put, it keeps mapping stream positions to the rings
+    memset(e->tap->ring, 0, sizeof(e->tap->ring));
+
+    mr_reset(e);
+    sdft_reset(e);
+}
+
+void engine_prime(Engine *e, const float *fs, unsigned int frames)
+{
+    // Starts over from audio that was already played up to the current
+    // stream position (the window before a seek target), so the next
+    // analysis is right without waiting for the tap to refill. Must not run
+    // while engine_push can be called.
+    unsigned int block = atomic_load(&e->tapBlock);
+
+    engine_reset(e);
+    engine_push(e, fs, frames);
+
+    // engine_push timed the frames as about to be played. Keep the device
+    // block size (the latency estimate) and put the newest primed frame just
+    // before whatever the device plays next.
+    atomic_store(&e->tapBlock, block);
+    atomic_store(&e->tapTime, wall_time() - ((block > 0) ? block - 1 : 0) / (double)e->tapRate);
+}
+
+
+static bool arena_init(Arena *a, size_t cap)
+{
+    // malloc only promises alignment for the largest scalar type, so ask for
+    // one alignment unit more and start at the first aligned byte
+    a->block = malloc(cap + ARENA_ALIGN);
+    if (a->block == NULL) return false;
+
+    uintptr_t p = (uintptr_t)a->block;
+    a->base = (unsigned char *)((p + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    a->used = 0;
+    a->cap = cap;
+    memset(a->base, 0, cap);
+
+    return true;
+}
+
+static void *arena_alloc(Arena *a, size_t size)
+{
+    // Zeroed, ARENA_ALIGN aligned, lives as long as the arena
+    size = ARENA_SIZE(size);
+    if (a->used + size > a->cap) return NULL;
+
+    void *p = a->base + a->used;
+    a->used += size;
+
+    return p;
+}
+
+static void arena_free(Arena *a)
+{
+    free(a->block);
+    memset(a, 0, sizeof(*a));
+}
+
+static void tap_deinterleave(Engine *e, const float *src, size_t frames)
+{
+    unsigned int ch = e->tap->channels;
+
+    while (frames > 0)
+    {
+        // Contiguous run up to the end of the rings
+        size_t pos = e->tap->head;
+        size_t run = (frames < TAP_RING - pos) ? frames : TAP_RING - pos;
+        size_t i = 0;
+
+#ifdef __SSE2__
+        if (ch == 2) {
+            // L0 R0 L1 R1 | L2 R2 L3 R3 -> L0 L1 L2 L3, R0 R1 R2 R3
+            float *l = e->tap->ring[0] + pos;
+            float *r = e->tap->ring[1] + pos;
+
+            for (; i + 4 <= run; i += 4)
+            {
+                __m128 a = _mm_loadu_ps(src + 2 * i);
+                __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+                _mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+                _mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+            }
+        } else if (ch > 2) {
+            // Four frames at a time: each group of four channels is a 4x4
+            // transpose, leftover channels are gathered with a stride
+            for (; i + 4 <= run; i += 4)
+            {
+                const float *f = src + i * ch;
+                unsigned int c = 0;
+
+                for (; c + 4 <= ch; c += 4)
+                {
+                    __m128 r0 = _mm_loadu_ps(f + c);
+                    __m128 r1 = _mm_loadu_ps(f + ch + c);
+                    __m128 r2 = _mm_loadu_ps(f + 2 * ch + c);
+                    __m128 r3 = _mm_loadu_ps(f + 3 * ch + c);
+                    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                    _mm_storeu_ps(e->tap->ring[c] + pos + i, r0);
+                    _mm_storeu_ps(e->tap->ring[c + 1] + pos + i, r1);
+                    _mm_storeu_ps(e->tap->ring[c + 2] + pos + i, r2);
+                    _mm_storeu_ps(e->tap->ring[c + 3] + pos + i, r3);
+                }
+
+                for (; c < ch; c++)
+                    _mm_storeu_ps(e->tap->ring[c] + pos + i, _mm_setr_ps(f[c], f[ch + c], f[2 * ch + c], f[3 * ch + c]));
+            }
+        }
+#endif
+
+        for (; i < run; i++)
+            for (unsigned int c = 0; c < ch; c++)
+                e->tap->ring[c][pos + i] = src[i * ch + c];
+
+        e->tap->head = (pos + run) & (TAP_RING - 1);
+        src += run * ch;
+        frames -= run;
+    }
+}
+
+static void tap_linearize(Engine *e, size_t end)
+{
+    // The N samples of the displayed pair up to stream position end, oldest
+    // first, as the FFT input. Positioned from the stream count alone (frame
+    // p sits at p & (TAP_RING - 1)), never from the head engine_push is
+    // moving on the audio thread.
+    const float *l = e->tap->ring[e->tap->pair[0]];
+    const float *r = e->tap->ring[e->tap->pair[1]];
+    size_t start = end - N;
+
+    for (size_t i = 0; i < N; i++)
+    {
+        size_t j = (start + i) & (TAP_RING - 1);
+        e->fft->in_rawL[i] = l[j];
+        e->fft->in_rawR[i] = r[j];
+    }
+}
+
+static void _fft(float complex in[], float complex out[], int n, int step)
+{
+    if (step < n)
+    {
+        _fft(out, in, n, step * 2);
+        _fft(out + step, in + step, n, step * 2);
+
+        for (int i = 0; i < n; i += 2 * step)
+        {
+            float complex t = cexp(-I * PI * i / n) * out[i + step];
+            in[i / 2] = out[i] + t;
+            in[(i + n) / 2] = out[i] - t;
+        }
+    }
+}
+
+static void fft_transform(Engine *e)
+{
+    // Both channels windowed and packed into one complex transform, L + iR
+    float complex *x = e->fft->out_rawL;
+    for (size_t i = 0; i < N; i++)
+        x[i] = (crealf(e->fft->in_rawL[i]) + crealf(e->fft->in_rawR[i]) * I) * e->hann[i];
+
+#if N >= FOURSTEP_MIN
+    // Large sizes go through the four-step FFT
+    fft_fourstep(e, e->bigPlan, x, true);
+#else
+    fft_radix2(e->twiddle, x, N);
+#endif
+
+    // Split into the two real spectra, L[k] = (Z[k] + Z*[N-k]) / 2 and
+    // R[k] = (Z[k] - Z*[N-k]) / 2i. Going down from nyquist, every Z[k] is
+    // read before bin k (or N - k) is overwritten. Only bins up to nyquist
+    // are used.
+    for (size_t k = N / 2 + 1; k-- > 0;)
+    {
+        float complex z = x[k];
+        float complex zc = conjf(x[(N - k) & (N - 1)]);
+        e->fft->out_rawR[k] = (z - zc) * -0.5f * I;
+        e->fft->out_rawL[k] = (z + zc) * 0.5f;
+    }
+}
+
+static float fast_log10(float x)
+{
+    // For normal x > 0. Exponent from the float bits, log2 of the mantissa
+    // t + 1 in [1, 2) from a degree 5 fit of log2(1 + t) / t; absolute error
+    // below 2e-5 in log2, 6e-6 in log10. Branch free so loops over it vectorize.
+    union { float f; uint32_t u; } v = { .f = x };
+    float e = (float)((int32_t)(v.u >> 23) - 127);
+    v.u = (v.u & 0x007FFFFF) | 0x3F800000;
+    float t = v.f - 1.0f;
+
+    float p = 0.0452682925f;
+    p = p * t - 0.193516524f;
+    p = p * t + 0.41524556f;
+    p = p * t - 0.708865218f;
+    p = p * t + 1.4418799f;
+
+    return (e + p * t) * 0.30102999566f;
+}
+
+static void spectrum_log_normalize(float *restrict outL, float *restrict outR, size_t s, float max2L, float max2R)
+{
+    // outL/outR hold squared band magnitudes on entry. log10(1 + m) is
+    // monotonic, so the largest output comes from the largest input and the
+    // normalization factor is known before the loop.
+    float normL = 1.0f / fmaxf(1.0f, fast_log10(1.0f + sqrtf(max2L)));
+    float normR = 1.0f / fmaxf(1.0f, fast_log10(1.0f + sqrtf(max2R)));
+
+    for (size_t i = 0; i < s; i++)
+    {
+        outL[i] = fast_log10(1.0f + sqrtf(outL[i])) * normL;
+        outR[i] = fast_log10(1.0f + sqrtf(outR[i])) * normR;
+    }
+}
+
+static void band_layout(Engine *e, size_t bands)
+{
+    // 0 gives the BAND_STEP progression. Otherwise exactly that many bands:
+    // single bins up to BAND_LINEAR, then each band takes its geometric
+    // share of what is left (never less than one bin, and leaving one for
+    // every band after it), so the last one ends right at nyquist.
+    uint32_t *edge = e->bandEdge;
+    size_t s = 0;
+
+    if (bands == 0) {
+        float step = BAND_STEP;
+        for (float f = 1.0f; (size_t)f < N / 2; f = ceil(f * step))
+        {
+            float f1 = ceil(f * step);
+            edge[s++] = (uint32_t)f;
+            edge[s] = ((size_t)f1 < N / 2) ? (uint32_t)f1 : N / 2;
+        }
+    } else {
+        for (s = 0; s <= BAND_LINEAR; s++)
+            edge[s] = (uint32_t)(s + 1);
+
+        for (s = BAND_LINEAR; s < bands; s++)
+        {
+            size_t left = bands - s;
+            double ratio = pow((double)(N / 2) / edge[s], 1.0 / left);
+            size_t next = (size_t)lround(edge[s] * ratio);
+
+            if (next < edge[s] + 1) next = edge[s] + 1;
+            if (next > N / 2 - (left - 1)) next = N / 2 - (left - 1);
+            edge[s + 1] = (uint32_t)next;
+        }
+    }
+
+    e->bandCount = s;
+}
+
+static size_t fft_process(Engine *e)
+{
+    fft_transform(e);
+
+    // Squash Frequencies
+    // Provides for more resolution in lower frequency bins, one display band
+    // per entry of the band layout
+    size_t s = 0;
+    float max2L = 0.0f;
+    float max2R = 0.0f;
+
+    // Single pass over the spectrum: the band maxima are picked on squared
+    // magnitudes (no sqrt per bin) and the overall maxima come along for free
+    for (s = 0; s < e->bandCount; s++)
+    {
+        float maxL = 0.0f;          // Max Left squared amp
+        float maxR = 0.0f;          // Max Right squared amp
+
+        for (size_t q = e->bandEdge[s]; q < e->bandEdge[s + 1]; q++)
+        {
+            float complex l = e->fft->out_rawL[q];
+            float complex r = e->fft->out_rawR[q];
+            float l2 = crealf(l) * crealf(l) + cimagf(l) * cimagf(l);
+            float r2 = crealf(r) * crealf(r) + cimagf(r) * cimagf(r);
+            maxL = fmaxf(maxL, l2);
+            maxR = fmaxf(maxR, r2);
+        }
+
+        e->fft->out_logL[s] = maxL;
+        e->fft->out_logR[s] = maxR;
+        max2L = fmaxf(max2L, maxL);
+        max2R = fmaxf(max2R, maxR);
+    }
+
+    // Scale logarithmically and normalize
+    spectrum_log_normalize(e->fft->out_logL, e->fft->out_logR, s, max2L, max2R);
+
+    return s;
+}
+
+static void cqt_init(Engine *e, int binsPerOctave, float fmin, unsigned int sampleRate)
+{
+    if (e->cq != NULL && e->cq->binsPerOctave == binsPerOctave && e->cq->fmin == fmin && e->cq->sampleRate == sampleRate)
+        return;
+
+    cqt_free(e);
+
+    e->cq = (CQ_Kernel *)malloc(sizeof(CQ_Kernel));
+    memset(e->cq, 0, sizeof(CQ_Kernel));
+    e->cq->binsPerOctave = binsPerOctave;
+    e->cq->fmin = fmin;
+    e->cq->sampleRate = sampleRate;
+
+    // Stop short of nyquist so the top kernels still fit in the spectrum
+    double fmax = 0.45 * sampleRate;
+    double Q = 1.0 / (pow(2.0, 1.0 / binsPerOctave) - 1.0);
+    e->cq->bins = (size_t)floor(binsPerOctave * log2(fmax / fmin));
+
+    e->cq->first = (int *)malloc(e->cq->bins * sizeof(int));
+    e->cq->count = (int *)malloc(e->cq->bins * sizeof(int));
+    e->cq->offset = (size_t *)malloc(e->cq->bins * sizeof(size_t));
+
+    size_t cap = 0;
+    double complex *row = (double complex *)malloc(N * sizeof(double complex));
+
+    for (size_t k = 0; k < e->cq->bins; k++)
+    {
+        double fk = fmin * pow(2.0, (double)k / binsPerOctave);
+
+        // Window length for this Q, capped by the frame. The capped bass bins
+        // end up with the resolution of the FFT itself.
+        int len = (int)ceil(Q * sampleRate / fk);
+        if (len > N) len = N;
+        int start = (N - len) / 2;
+
+        // The temporal kernel is hann * exp(2*pi*i*fk*n/fs), scaled by N/len so
+        // a sine reads the same as its peak in the hann windowed FFT. Its DFT
+        // only has energy within a few main lobe widths of the center bin,
+        // so only that neighbourhood is evaluated.
+        double center = fk * N / sampleRate;
+        int halfWidth = (int)ceil(2.0 * N / len) + 4;
+        int lo = (int)center - halfWidth;
+        int hi = (int)center + halfWidth;
+        if (lo < 0) lo = 0;
+        if (hi > N / 2 - 1) hi = N / 2 - 1;
+
+        double peak = 0.0;
+        for (int j = lo; j <= hi; j++)
+        {
+            // hann = 0.5 - 0.25 * (exp(i*phi*n) + exp(-i*phi*n)), so the DFT
+            // of the kernel is three geometric sums in closed form
+            double theta = 2.0 * PI * (fk / sampleRate - (double)j / N);
+            double phi = 2.0 * PI / (len - 1);
+            double complex acc = 0.5 * cqt_geosum(theta, len)
+                               - 0.25 * cqt_geosum(theta + phi, len)
+                               - 0.25 * cqt_geosum(theta - phi, len);
+            acc *= cexp(-I * 2.0 * PI * (double)j * start / N);
+
+            // Fold in the 1/N of Parseval and take the conjugate
+            row[j - lo] = conj(acc * ((double)N / len)) / N;
+            if (cabs(row[j - lo]) > peak) peak = cabs(row[j - lo]);
+        }
+
+        // Trim the tails below the threshold from both ends
+        while (lo < hi && cabs(row[0]) < CQ_THRESHOLD * peak)
+        {
+            memmove(row, row + 1, (hi - lo) * sizeof(row[0]));
+            lo++;
+        }
+        while (hi > lo && cabs(row[hi - lo]) < CQ_THRESHOLD * peak) hi--;
+
+        e->cq->first[k] = lo;
+        e->cq->count[k] = hi - lo + 1;
+        e->cq->offset[k] = cap;
+
+        e->cq->val = (float complex *)realloc(e->cq->val, (cap + e->cq->count[k]) * sizeof(float complex));
+        for (int j = 0; j < e->cq->count[k]; j++)
+            e->cq->val[cap + j] = (float complex)row[j];
+        cap += e->cq->count[k];
+    }
+
+    e->cq->nnz = cap;
+    free(row);
+
+    printf("INFO: CQT %zu bins, %d per octave from %.1f Hz at %u Hz, %zu kernel values\n",
+        e->cq->bins, binsPerOctave, fmin, sampleRate, e->cq->nnz);
+}
+
+static double complex cqt_geosum(double a, int len)
+{
+    // sum_{n < len} exp(i*a*n)
+    double complex d = 1.0 - cexp(I * a);
+    if (cabs(d) < 1e-12) return len;
+    return (1.0 - cexp(I * a * len)) / d;
+}
+
+static void cqt_free(Engine *e)
+{
+    if (e->cq == NULL) return;
+
+    free(e->cq->first);
+    free(e->cq->count);
+    free(e->cq->offset);
+    free(e->cq->val);
+    free(e->cq);
+    e->cq = NULL;
+}
+
+static size_t cqt_process(Engine *e)
+{
+    cqt_init(e, CQ_BPO, CQ_FMIN, e->tapRate);
+
+    fft_transform(e);
+
+    float max_ampL = 1.0f;
+    float max_ampR = 1.0f;
+
+    // Sparse matrix-vector product, one contiguous run per constant-Q bin
+    for (size_t k = 0; k < e->cq->bins; k++)
+    {
+        const float complex *kv = e->cq->val + e->cq->offset[k];
+        const float complex *xl = e->fft->out_rawL + e->cq->first[k];
+        const float complex *xr = e->fft->out_rawR + e->cq->first[k];
+        float complex accL = 0.0f;
+        float complex accR = 0.0f;
+
+        for (int j = 0; j < e->cq->count[k]; j++)
+        {
+            accL += kv[j] * xl[j];
+            accR += kv[j] * xr[j];
+        }
+
+        float l = log10f(1.0f + cabsf(accL));
+        float r = log10f(1.0f + cabsf(accR));
+        if (l > max_ampL) max_ampL = l;
+        if (r > max_ampR) max_ampR = r;
+
+        e->fft->out_logL[k] = l;
+        e->fft->out_logR[k] = r;
+    }
+
+    for (size_t k = 0; k < e->cq->bins; k++)
+    {
+        e->fft->out_logL[k] = e->fft->out_logL[k] / max_ampL;
+        e->fft->out_logR[k] = e->fft->out_logR[k] / max_ampR;
+    }
+
+    return e->cq->bins;
+}
+
+static void mr_init(Engine *e)
+{
+
+    // Blackman windowed sinc with the cutoff at the output nyquist. Every
+    // even offset from the center lands on a zero of the sinc.
+    int c = (HB_TAPS - 1) / 2;
+    float sum = 0.0f;
+    for (int n = 0; n < HB_TAPS; n++)
+    {
+        float x = (n - c) / 2.0f;
+        float sinc = (n == c) ? 1.0f : sinf(PI * x) / (PI * x);
+        float t = (float)n / (HB_TAPS - 1);
+        float blackman = 0.42f - 0.5f * cosf(2 * PI * t) + 0.08f * cosf(4 * PI * t);
+        e->mr->hb[n] = sinc * blackman;
+        if ((n - c) % 2 == 0 && n != c) e->mr->hb[n] = 0.0f;
+        sum += e->mr->hb[n];
+    }
+    for (int n = 0; n < HB_TAPS; n++) e->mr->hb[n] /= sum;
+
+    for (size_t i = 0; i < MR_N; i++)
+    {
+        float t = (float)i / (MR_N - 1);
+        e->mr->hann[i] = 0.5f - 0.5f * cosf(2 * PI * t);
+    }
+}
+
+static void mr_reset(Engine *e)
+{
+    memset(e->mr->stage, 0, sizeof(e->mr->stage));
+    memset(e->mr->ringL, 0, sizeof(e->mr->ringL));
+    memset(e->mr->ringR, 0, sizeof(e->mr->ringR));
+    memset(e->mr->head, 0, sizeof(e->mr->head));
+}
+
+static void mr_push(Engine *e, int level, float l, float r)
+{
+    e->mr->ringL[level][e->mr->head[level]] = l;
+    e->mr->ringR[level][e->mr->head[level]] = r;
+    e->mr->head[level] = (e->mr->head[level] + 1) & (MR_N - 1);
+
+    if (level == MR_LEVELS - 1) return;
+
+    HalfBand *hb = &e->mr->stage[level];
+    hb->histL[hb->pos] = hb->histL[hb->pos + HB_TAPS] = l;
+    hb->histR[hb->pos] = hb->histR[hb->pos + HB_TAPS] = r;
+    hb->pos = (hb->pos + 1) % HB_TAPS;
+    hb->phase ^= 1;
+
+    if (hb->phase) return;
+
+    // hist + pos is the window oldest first. The taps are symmetric, so pair
+    // up mirrored samples and only walk the non-zero (odd offset) half.
+    const float *wl = hb->histL + hb->pos;
+    const float *wr = hb->histR + hb->pos;
+    int c = (HB_TAPS - 1) / 2;
+    float yl = e->mr->hb[c] * wl[c];
+    float yr = e->mr->hb[c] * wr[c];
+
+    for (int k = 1; k <= c; k += 2)
+    {
+        yl += e->mr->hb[c + k] * (wl[c - k] + wl[c + k]);
+        yr += e->mr->hb[c + k] * (wr[c - k] + wr[c + k]);
+    }
+
+    mr_push(e, level + 1, yl, yr);
+}
+
+static size_t mr_process(Engine *e)
+{
+    // Transform every level: both channels packed into one complex FFT
+    for (int d = 0; d < MR_LEVELS; d++)
+    {
+        for (size_t i = 0; i < MR_N; i++)
+        {
+            size_t j = (e->mr->head[d] + i) & (MR_N - 1);
+            e->mr->in[i] = (e->mr->ringL[d][j] + e->mr->ringR[d][j] * I) * e->mr->hann[i];
+        }
+
+        fft_radix2(e->twiddle, e->mr->in, MR_N);
+
+        // Scaled by N / MR_N so every level reads like the full N point FFT
+        for (size_t k = 0; k < MR_N / 2; k++)
+        {
+            float complex z = e->mr->in[k];
+            float complex zc = conjf(e->mr->in[(MR_N - k) & (MR_N - 1)]);
+            e->mr->magL[d][k] = cabsf(z + zc) * 0.5f * (N / MR_N);
+            e->mr->magR[d][k] = cabsf(z - zc) * 0.5f * (N / MR_N);
+        }
+    }
+
+    // Stitch into the fft_process band layout (bins of a virtual N point FFT).
+    // Level d is trusted from 0.2 to 0.4 of the full band scaled by 2^-d,
+    // below the half-band transition; level 0 also takes the top, the last
+    // level everything below.
+    size_t s = 0;
+    float max_ampL = 1.0f;
+    float max_ampR = 1.0f;
+
+    for (s = 0; s < e->bandCount; s++)
+    {
+        size_t q0 = e->bandEdge[s];
+        size_t q1 = e->bandEdge[s + 1];
+
+        int d = 0;
+        while (d < MR_LEVELS - 1 && q0 * 5 < (size_t)(N >> d)) d++;
+
+        // Virtual bins per level bin
+        int shift = MR_LEVELS - 1 - d;
+        size_t b0 = q0 >> shift;
+        size_t b1 = (q1 + (1 << shift) - 1) >> shift;
+        if (b1 <= b0) b1 = b0 + 1;
+
+        float maxL = 0.0f;
+        float maxR = 0.0f;
+        for (size_t b = b0; b < b1 && b < MR_N / 2; b++)
+        {
+            if (e->mr->magL[d][b] > maxL) maxL = e->mr->magL[d][b];
+            if (e->mr->magR[d][b] > maxR) maxR = e->mr->magR[d][b];
+        }
+
+        e->fft->out_logL[s] = log10f(1.0f + maxL);
+        e->fft->out_logR[s] = log10f(1.0f + maxR);
+        if (e->fft->out_logL[s] > max_ampL) max_ampL = e->fft->out_logL[s];
+        if (e->fft->out_logR[s] > max_ampR) max_ampR = e->fft->out_logR[s];
+    }
+
+    for (size_t i = 0; i < s; i++)
+    {
+        e->fft->out_logL[i] = e->fft->out_logL[i] / max_ampL;
+        e->fft->out_logR[i] = e->fft->out_logR[i] / max_ampR;
+    }
+
+    return s;
+}
+
+static void pool_init(Worker_Pool *pool)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    int want = pool_cpus() - 1;
+    if (want > POOL_MAX_THREADS) want = POOL_MAX_THREADS;
+
+    // Jobs nobody else picks up are run by pool_run's caller, so fewer
+    // workers than asked for (or none) only costs speed
+    for (int i = 0; i < want; i++)
+    {
+        int err = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+        if (err != 0) {
+            printf("ERROR: Could not start pool worker %d of %d (error %d)\n", i + 1, want, err);
+            break;
+        }
+        pool->threadCount++;
+    }
+}
+
+static int pool_cpus()
+{
+    // Online CPUs, at least 1
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int n = (int)si.dwNumberOfProcessors;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return (n > 0) ? n : 1;
+}
+
+static void pool_free(Worker_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threadCount; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+}
+
+static void pool_take(Worker_Pool *pool, unsigned int batch)
+{
+    // Called with the lock held, runs jobs of the given batch until none are left
+    while (pool->batch == batch && pool->next < pool->count)
+    {
+        int job = pool->next++;
+        Pool_Job fn = pool->fn;
+        void *ctx = pool->ctx;
+
+        pthread_mutex_unlock(&pool->lock);
+        fn(ctx, job);
+        pthread_mutex_lock(&pool->lock);
+
+        if (++pool->finished == pool->count)
+            pthread_cond_signal(&pool->idle);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    Worker_Pool *pool = arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit)
+    {
+        if (pool->batch == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+            continue;
+        }
+
+        seen = pool->batch;
+        pool_take(pool, seen);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void pool_run(Worker_Pool *pool, Pool_Job fn, void *ctx, int count)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->wake);
+
+    pool_take(pool, pool->batch);
+    while (pool->finished < pool->count)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void fft_radix2(const float complex *tw, float complex *x, int n)
+{
+    // In-place iterative radix-2 DIT for any power of two n <= N, reading the
+    // N point twiddle table tw with a stride of N / len
+    for (int i = 1, j = 0; i < n; i++)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if (i < j) {
+            float complex tmp = x[i];
+            x[i] = x[j];
+            x[j] = tmp;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1)
+    {
+        int half = len / 2;
+        int stride = N / len;
+
+        for (int i = 0; i < n; i += len)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                float complex u = x[i + k];
+                float complex v = x[i + k + half] * tw[k * stride];
+                x[i + k] = u + v;
+                x[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+static FFT_Plan *fft_plan_create(int n)
+{
+    // Both stages are radix-2 transforms on the N point twiddle table, so
+    // neither side of the n1 x n2 split may be longer than N
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+
+    int n1 = 1 << (bits / 2);
+    int n2 = n / n1;
+    if (n != (1 << bits) || n1 > N || n2 > N) {
+        printf("ERROR: No four-step plan for %d points (rows and columns are limited to %d)\n", n, N);
+        return NULL;
+    }
+
+    FFT_Plan *p = (FFT_Plan *)malloc(sizeof(FFT_Plan));
+    memset(p, 0, sizeof(FFT_Plan));
+
+    p->n = n;
+    p->n1 = n1;
+    p->n2 = n2;
+    p->tmp = (float complex *)malloc(n * sizeof(float complex));
+    p->tw = (float complex *)malloc(n * sizeof(float complex));
+
+    for (int j2 = 0; j2 < p->n2; j2++)
+        for (int k1 = 0; k1 < p->n1; k1++)
+            p->tw[j2 * p->n1 + k1] = cexp(-2.0 * I * PI * ((double)j2 * k1) / n);
+
+    return p;
+}
+
+static void fft_plan_free(FFT_Plan *p)
+{
+    if (p == NULL) return;
+
+    free(p->tmp);
+    free(p->tw);
+    free(p);
+}
+
+static void fft_transpose(const float complex *src, float complex *dst, int rows, int cols, int r0, int r1)
+{
+    // dst (cols x rows) = transpose of rows [r0, r1) of src (rows x cols),
+    // in FOURSTEP_BLOCK tiles so both sides stay in cache
+    for (int rb = r0; rb < r1; rb += FOURSTEP_BLOCK)
+    {
+        int re = (rb + FOURSTEP_BLOCK < r1) ? rb + FOURSTEP_BLOCK : r1;
+
+        for (int cb = 0; cb < cols; cb += FOURSTEP_BLOCK)
+        {
+            int ce = (cb + FOURSTEP_BLOCK < cols) ? cb + FOURSTEP_BLOCK : cols;
+
+            for (int r = rb; r < re; r++)
+                for (int c = cb; c < ce; c++)
+                    dst[c * rows + r] = src[r * cols + c];
+        }
+    }
+}
+
+static void fft_fourstep_job(void *ctx, int job)
+{
+    FFT_Plan *p = ctx;
+
+    // Rows of the matrix this pass works on, split evenly across the jobs
+    int rows = (p->pass == 1 || p->pass == 2) ? p->n2 : p->n1;
+    int r0 = rows * job / FOURSTEP_JOBS;
+    int r1 = rows * (job + 1) / FOURSTEP_JOBS;
+
+    switch (p->pass)
+    {
+        case 0: // x (n1 x n2) -> tmp (n2 x n1), columns become rows
+            fft_transpose(p->x, p->tmp, p->n1, p->n2, r0, r1);
+            break;
+        case 1: // Length n1 FFTs, then the twiddles between the two stages
+            for (int r = r0; r < r1; r++)
+            {
+                float complex *row = p->tmp + (size_t)r * p->n1;
+                const float complex *tw = p->tw + (size_t)r * p->n1;
+
+                fft_radix2(p->twiddle, row, p->n1);
+                for (int k = 0; k < p->n1; k++)
+                    row[k] *= tw[k];
+            }
+            break;
+        case 2: // tmp (n2 x n1) -> x (n1 x n2)
+            fft_transpose(p->tmp, p->x, p->n2, p->n1, r0, r1);
+            break;
+        case 3: // Length n2 FFTs
+            for (int r = r0; r < r1; r++)
+                fft_radix2(p->twiddle, p->x + (size_t)r * p->n2, p->n2);
+            break;
+        case 4: // x (n1 x n2) -> tmp (n2 x n1), which is natural output order
+            fft_transpose(p->x, p->tmp, p->n1, p->n2, r0, r1);
+            break;
+        default:
+            break;
+    }
+}
+
+static void fft_fourstep(Engine *e, FFT_Plan *p, float complex *x, bool threaded)
+{
+    // X[k1 + n1*k2] = sum_j2 W_n2^(j2*k2) * W_n^(j2*k1) * sum_j1 x[j1*n2 + j2] * W_n1^(j1*k1)
+    p->x = x;
+    p->twiddle = e->twiddle;
+
+    for (p->pass = 0; p->pass < 5; p->pass++)
+    {
+        if (threaded) {
+            pool_run(e->pool, fft_fourstep_job, p, FOURSTEP_JOBS);
+        } else {
+            for (int j = 0; j < FOURSTEP_JOBS; j++)
+                fft_fourstep_job(p, j);
+        }
+    }
+
+    memcpy(x, p->tmp, p->n * sizeof(float complex));
+}
+
+static void fft_bench_large(Engine *e)
+{
+    // Recursive stride doubling _fft against the four-step FFT, on one thread
+    // and on the pool, for sizes past the current N
+    for (int n = FOURSTEP_MIN; n <= (1 << 18); n <<= 2)
+    {
+        FFT_Plan *p = fft_plan_create(n);
+        if (p == NULL) continue;
+
+        float complex *a = (float complex *)malloc(n * sizeof(float complex));
+        float complex *b = (float complex *)malloc(n * sizeof(float complex));
+        float complex *ref = (float complex *)malloc(n * sizeof(float complex));
+        int iterations = 5;
+
+        for (int i = 0; i < n; i++)
+            ref[i] = sinf(0.001f * i) + 0.5f * ((float)rand() / RAND_MAX - 0.5f);
+
+        double t0 = wall_time();
+        for (int it = 0; it < iterations; it++)
+        {
+            memcpy(a, ref, n * sizeof(float complex));
+            memcpy(b, ref, n * sizeof(float complex));
+            _fft(b, a, n, 1);
+        }
+        double t1 = wall_time();
+
+        float complex *c = a;
+        for (int it = 0; it < iterations; it++)
+        {
+            memcpy(c, ref, n * sizeof(float complex));
+            fft_fourstep(e, p, c, false);
+        }
+        double t2 = wall_time();
+
+        for (int it = 0; it < iterations; it++)
+        {
+            memcpy(c, ref, n * sizeof(float complex));
+            fft_fourstep(e, p, c, true);
+        }
+        double t3 = wall_time();
+
+        double err = 0.0;
+        double mag = 0.0;
+        for (int i = 0; i < n; i++)
+        {
+            err = fmax(err, cabsf(c[i] - b[i]));
+            mag = fmax(mag, cabsf(b[i]));
+        }
+
+        double msR = 1000.0 * (t1 - t0) / iterations;
+        double ms1 = 1000.0 * (t2 - t1) / iterations;
+        double msP = 1000.0 * (t3 - t2) / iterations;
+        printf("INFO:\t  > n=%d recursive %.2f ms, four-step %.2f ms, %d threads %.2f ms (%.2fx), rel err %.1e\n",
+            n, msR, ms1, e->pool->threadCount + 1, msP, (msP > 0.0) ? ms1 / msP : 0.0, err / mag);
+
+        fft_plan_free(p);
+        free(a);
+        free(b);
+        free(ref);
+    }
+}
+
+static void twiddle_init(Engine *e)
+{
+    for (size_t k = 0; k < N / 2; k++)
+        e->twiddle[k] = cexp(-2.0 * I * PI * k / N);
+
+    for (size_t i = 0; i < N; i++)
+    {
+        float t = (float)i / (N - 1);
+        e->hann[i] = 0.5f - 0.5f * cosf(2 * PI * t);
+    }
+}
+
+static float complex twiddle_full(Engine *e, size_t j)
+{
+    // exp(-2*pi*i*j/N) for any j in [0, N), the upper half is the negated lower
+    return (j < N / 2) ? e->twiddle[j] : -e->twiddle[j - N / 2];
+}
+
+static void sdft_init(Engine *e, const int *bins, int count)
+{
+
+    if (count > SDFT_MAX_BINS) count = SDFT_MAX_BINS;
+
+    for (int i = 0; i < count; i++)
+    {
+        int k = bins[i];
+        if (k < 1 || k >= N / 2 - 1) continue;
+
+        e->sdft->bin[e->sdft->count] = k;
+
+        for (int o = 0; o < 3; o++)
+        {
+            int want = k - 1 + o;
+            int slot = 0;
+            while (slot < e->sdft->rawCount && e->sdft->raw[slot] != want) slot++;
+            if (slot == e->sdft->rawCount) e->sdft->raw[e->sdft->rawCount++] = want;
+            e->sdft->idx[e->sdft->count][o] = slot;
+        }
+
+        e->sdft->count++;
+    }
+}
+
+static void sdft_reset(Engine *e)
+{
+    memset(e->sdft->yL, 0, sizeof(e->sdft->yL));
+    memset(e->sdft->yR, 0, sizeof(e->sdft->yR));
+    e->sdft->n = 0;
+}
+
+static void sdft_push(Engine *e, float l, float r, float oldL, float oldR)
+{
+    // Y_k += (x[n] - x[n - N]) * W^(k*n), W = exp(-2*pi*i/N)
+    double dl = (double)l - oldL;
+    double dr = (double)r - oldR;
+
+    for (int j = 0; j < e->sdft->rawCount; j++)
+    {
+        double complex w = twiddle_full(e, ((size_t)e->sdft->raw[j] * e->sdft->n) & (N - 1));
+        e->sdft->yL[j] += dl * w;
+        e->sdft->yR[j] += dr * w;
+    }
+
+    e->sdft->n = (e->sdft->n + 1) & (N - 1);
+}
+
+static size_t sdft_log(Engine *e, float *outL, float *outR)
+{
+    // Back to window-relative phase, X_k = Y_k * W^(-k*n), then hann as
+    // 0.5 * X_k - 0.25 * (X_k-1 + X_k+1). Same scale and log as fft_process.
+    double complex xL[3 * SDFT_MAX_BINS];
+    double complex xR[3 * SDFT_MAX_BINS];
+    size_t n = e->sdft->n;
+
+    for (int j = 0; j < e->sdft->rawCount; j++)
+    {
+        double complex w = conj(twiddle_full(e, ((size_t)e->sdft->raw[j] * n) & (N - 1)));
+        xL[j] = e->sdft->yL[j] * w;
+        xR[j] = e->sdft->yR[j] * w;
+    }
+
+    float max_ampL = 1.0f;
+    float max_ampR = 1.0f;
+
+    for (int i = 0; i < e->sdft->count; i++)
+    {
+        const int *s = e->sdft->idx[i];
+        double complex hL = 0.5 * xL[s[1]] - 0.25 * (xL[s[0]] + xL[s[2]]);
+        double complex hR = 0.5 * xR[s[1]] - 0.25 * (xR[s[0]] + xR[s[2]]);
+
+        outL[i] = log10f(1.0f + (float)cabs(hL));
+        outR[i] = log10f(1.0f + (float)cabs(hR));
+        if (outL[i] > max_ampL) max_ampL = outL[i];
+        if (outR[i] > max_ampR) max_ampR = outR[i];
+    }
+
+    for (int i = 0; i < e->sdft->count; i++)
+    {
+        outL[i] /= max_ampL;
+        outR[i] /= max_ampR;
+    }
+
+    return e->sdft->count;
+}
+
+static void ms_init(Engine *e)
+{
+
+    for (int b = 0; b < MS_BANDS; b++)
+    {
+        for (int i = 0; i < msSize[b]; i++)
+        {
+            float t = (float)i / (msSize[b] - 1);
+            e->ms->hann[b][i] = 0.5f - 0.5f * cosf(2 * PI * t);
+        }
+    }
+}
+
+static void ms_band(void *ctx, int b)
+{
+    Engine *e = ctx;
+
+    // Newest msSize[b] samples of the shared input ring
+    int n = msSize[b];
+    const float complex *l = e->fft->in_rawL + (N - n);
+    const float complex *r = e->fft->in_rawR + (N - n);
+    float complex *x = e->ms->buf[b];
+
+    for (int i = 0; i < n; i++)
+        x[i] = (crealf(l[i]) + crealf(r[i]) * I) * e->ms->hann[b][i];
+
+    fft_radix2(e->twiddle, x, n);
+
+    // Unpack the two real spectra, scaled by N / n to the full size layout
+    float scale = 0.5f * N / n;
+    for (int k = 0; k < n / 2; k++)
+    {
+        float complex z = x[k];
+        float complex zc = conjf(x[(n - k) & (n - 1)]);
+        e->ms->magL[b][k] = cabsf(z + zc) * scale;
+        e->ms->magR[b][k] = cabsf(z - zc) * scale;
+    }
+}
+
+static size_t ms_process(Engine *e)
+{
+    pool_run(e->pool, ms_band, e, MS_BANDS);
+
+    size_t s = 0;
+    float max_ampL = 1.0f;
+    float max_ampR = 1.0f;
+
+    for (s = 0; s < e->bandCount; s++)
+    {
+        size_t q0 = e->bandEdge[s];
+        size_t q1 = e->bandEdge[s + 1];
+
+        int b = MS_BANDS - 1;
+        while (b > 0 && q0 < msFirst[b]) b--;
+
+        // Bins of the N point layout per bin of this band
+        size_t ratio = N / msSize[b];
+        size_t b0 = q0 / ratio;
+        size_t b1 = (q1 + ratio - 1) / ratio;
+        if (b1 <= b0) b1 = b0 + 1;
+
+        float maxL = 0.0f;
+        float maxR = 0.0f;
+        for (size_t k = b0; k < b1 && k < (size_t)msSize[b] / 2; k++)
+        {
+            if (e->ms->magL[b][k] > maxL) maxL = e->ms->magL[b][k];
+            if (e->ms->magR[b][k] > maxR) maxR = e->ms->magR[b][k];
+        }
+
+        e->fft->out_logL[s] = log10f(1.0f + maxL);
+        e->fft->out_logR[s] = log10f(1.0f + maxR);
+        if (e->fft->out_logL[s] > max_ampL) max_ampL = e->fft->out_logL[s];
+        if (e->fft->out_logR[s] > max_ampR) max_ampR = e->fft->out_logR[s];
+    }
+
+    for (size_t i = 0; i < s; i++)
+    {
+        e->fft->out_logL[i] = e->fft->out_logL[i] / max_ampL;
+        e->fft->out_logR[i] = e->fft->out_logR[i] / max_ampR;
+    }
+
+    return s;
+}
+
+static size_t spectrum_analyze(Engine *e, size_t end)
+{
+    tap_linearize(e, end);
+
+    switch (e->analysisMode)
+    {
+        case ANALYSIS_CQT:
+            return cqt_process(e);
+        case ANALYSIS_MULTIRATE:
+            return mr_process(e);
+        case ANALYSIS_MULTIRES:
+            return ms_process(e);
+        default:
+            return (e->useQ15) ? fftq_process(e) : fft_process(e);
+    }
+}
+
+static void fftq_init(Engine *e)
+{
+
+    // Tables are built once in float, everything per frame is integer
+    for (size_t i = 0; i < N; i++)
+    {
+        float t = (float)i / (N - 1);
+        e->fftq->hann[i] = (int16_t)lrintf((0.5f - 0.5f * cosf(2 * PI * t)) * 32767.0f);
+    }
+
+    for (size_t k = 0; k < N / 2; k++)
+    {
+        double a = 2.0 * PI * k / N;
+        e->fftq->twRe[k] = (int16_t)lrint(cos(a) * 32767.0);
+        e->fftq->twIm[k] = (int16_t)lrint(-sin(a) * 32767.0);
+    }
+
+    int bits = 0;
+    while ((1 << bits) < N) bits++;
+
+    for (size_t i = 0; i < N; i++)
+    {
+        size_t r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        e->fftq->rev[i] = (uint16_t)r;
+    }
+
+    for (int i = 0; i <= 32; i++)
+    {
+        e->fftq->log2Lut[i] = (int32_t)lrint(log2(1.0 + i / 32.0) * 65536.0);
+    }
+}
+
+static int fftq_transform(Engine *e)
+{
+    // In-place radix-2 DIT over fftq->re/im (already in bit reversed order).
+    // Returns the block exponent: true values are the stored ones * 2^exp.
+    int16_t *re = e->fftq->re;
+    int16_t *im = e->fftq->im;
+    int exp = 0;
+
+    int32_t peak = 0;
+    for (size_t i = 0; i < N; i++)
+    {
+        int32_t a = abs(re[i]);
+        int32_t b = abs(im[i]);
+        if (a > peak) peak = a;
+        if (b > peak) peak = b;
+    }
+
+    for (size_t half = 1; half < N; half <<= 1)
+    {
+        int shift = 0;
+        if (peak > Q15_HEADROOM) {
+            shift = 1;
+            exp++;
+        }
+
+        size_t twStep = N / (2 * half);
+        peak = 0;
+
+        for (size_t k = 0; k < N; k += 2 * half)
+        {
+            for (size_t j = 0; j < half; j++)
+            {
+                size_t a = k + j;
+                size_t b = a + half;
+
+                int32_t wr = e->fftq->twRe[j * twStep];
+                int32_t wi = e->fftq->twIm[j * twStep];
+
+                int32_t ar = re[a] >> shift;
+                int32_t ai = im[a] >> shift;
+                int32_t br = re[b] >> shift;
+                int32_t bi = im[b] >> shift;
+
+                int32_t tr = (br * wr - bi * wi + (1 << 14)) >> 15;
+                int32_t ti = (br * wi + bi * wr + (1 << 14)) >> 15;
+
+                re[a] = (int16_t)(ar + tr);
+                im[a] = (int16_t)(ai + ti);
+                re[b] = (int16_t)(ar - tr);
+                im[b] = (int16_t)(ai - ti);
+
+                int32_t m = abs(ar + tr);
+                if (abs(ai + ti) > m) m = abs(ai + ti);
+                if (abs(ar - tr) > m) m = abs(ar - tr);
+                if (abs(ai - ti) > m) m = abs(ai - ti);
+                if (m > peak) peak = m;
+            }
+        }
+    }
+
+    return exp;
+}
+
+static int32_t fftq_log2(Engine *e, uint32_t x)
+{
+    // Q16 log2 for x >= 1: exponent from the leading one, mantissa from a
+    // 32 segment table with linear interpolation (error below 1e-4)
+    int msb = 31 - __builtin_clz(x);
+    uint32_t y = x << (31 - msb);
+    uint32_t idx = (y >> 26) & 31;
+    int32_t t = (y >> 10) & 0xFFFF;
+    int32_t lo = e->fftq->log2Lut[idx];
+    int32_t hi = e->fftq->log2Lut[idx + 1];
+
+    return (msb << 16) + lo + (((hi - lo) * t) >> 16);
+}
+
+static uint32_t fftq_isqrt(uint32_t x)
+{
+    uint32_t r = 0;
+    uint32_t b = 1u << 30;
+
+    while (b > x) b >>= 2;
+
+    while (b != 0)
+    {
+        if (x >= r + b) {
+            x -= r + b;
+            r = (r >> 1) + b;
+        } else {
+            r >>= 1;
+        }
+        b >>= 2;
+    }
+
+    return r;
+}
+
+static size_t fftq_process(Engine *e)
+{
+    // Quantize the window tap_linearize just built (oldest sample first) and
+    // window it straight into bit reversed order, left channel as the real
+    // part and right as the imaginary part
+    for (size_t i = 0; i < N; i++)
+    {
+        float l = fminf(fmaxf(crealf(e->fft->in_rawL[i]), -1.0f), 1.0f);
+        float r = fminf(fmaxf(crealf(e->fft->in_rawR[i]), -1.0f), 1.0f);
+        int32_t h = e->fftq->hann[i];
+        e->fftq->re[e->fftq->rev[i]] = (int16_t)((lrintf(l * 32767.0f) * h) >> 15);
+        e->fftq->im[e->fftq->rev[i]] = (int16_t)((lrintf(r * 32767.0f) * h) >> 15);
+    }
+
+    int exp = fftq_transform(e);
+
+    // Split the packed spectrum Z = L + iR using the conjugate symmetry of
+    // real signals: L[k] = (Z[k] + Z*[N-k]) / 2, R[k] = (Z[k] - Z*[N-k]) / 2i
+    for (size_t k = 0; k < N / 2; k++)
+    {
+        size_t c = (N - k) & (N - 1);
+        int32_t zr = e->fftq->re[k];
+        int32_t zi = e->fftq->im[k];
+        int32_t cr = e->fftq->re[c];
+        int32_t ci = e->fftq->im[c];
+
+        int32_t lr = (zr + cr) >> 1;
+        int32_t li = (zi - ci) >> 1;
+        int32_t rr = (zi + ci) >> 1;
+        int32_t ri = (cr - zr) >> 1;
+
+        e->fftq->magL[k] = (uint32_t)(lr * lr) + (uint32_t)(li * li);
+        e->fftq->magR[k] = (uint32_t)(rr * rr) + (uint32_t)(ri * ri);
+    }
+
+    // Magnitudes are in units of 2^(exp - 15), so 1.0 is one << (15 - exp)
+    uint32_t one = 1u << (15 - exp);
+    int32_t oneLog = (15 - exp) << 16;
+
+    // Same band layout and max pick as fft_process, on squared magnitudes
+    size_t s = 0;
+    int32_t max_ampL = 65536;
+    int32_t max_ampR = 65536;
+
+    for (s = 0; s < e->bandCount; s++)
+    {
+        uint32_t maxL = 0;
+        uint32_t maxR = 0;
+
+        for (size_t q = e->bandEdge[s]; q < e->bandEdge[s + 1]; q++)
+        {
+            if (e->fftq->magL[q] > maxL) maxL = e->fftq->magL[q];
+            if (e->fftq->magR[q] > maxR) maxR = e->fftq->magR[q];
+        }
+
+        // log10(1 + m) = log2(1 + m) * log10(2), all in Q16
+        int32_t l = fftq_log2(e, fftq_isqrt(maxL) + one) - oneLog;
+        int32_t r = fftq_log2(e, fftq_isqrt(maxR) + one) - oneLog;
+        l = (int32_t)(((int64_t)l * 19728) >> 16);
+        r = (int32_t)(((int64_t)r * 19728) >> 16);
+
+        if (l > max_ampL) max_ampL = l;
+        if (r > max_ampR) max_ampR = r;
+
+        e->fftq->logL[s] = l;
+        e->fftq->logR[s] = r;
+    }
+
+    for (size_t i = 0; i < s; i++)
+    {
+        e->fft->out_logL[i] = (float)e->fftq->logL[i] / max_ampL;
+        e->fft->out_logR[i] = (float)e->fftq->logR[i] / max_ampR;
+    }
+
+    return s;
+}
+
+double wall_time()
+{
+    // Usable without a window, unlike GetTime()
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void engine_benchmark(Engine *e, int iterations)
+{
+    // Feed both engines the same synthetic stereo signal (a few partials plus
+    // noise) and compare throughput and the normalized display output
+    for (size_t i = 0; i < N; i++)
+    {
+        float t = (float)i / 44100.0f;
+        float l = 0.30f * sinf(2 * PI * 55.0f * t) + 0.20f * sinf(2 * PI * 440.0f * t)
+                + 0.05f * sinf(2 * PI * 7040.0f * t) + 0.02f * ((float)rand() / RAND_MAX - 0.5f);
+        float r = 0.25f * sinf(2 * PI * 110.0f * t) + 0.10f * sinf(2 * PI * 3520.0f * t)
+                + 0.02f * ((float)rand() / RAND_MAX - 0.5f);
+
+        e->fft->in_rawL[i] = l;
+        e->fft->in_rawR[i] = r;
+        mr_push(e, 0, l, r);
+    }
+
+    float *refL = (float *)malloc((N / 2) * sizeof(float));
+    float *refR = (float *)malloc((N / 2) * sizeof(float));
+
+    clock_t c0 = clock();
+    size_t bins = 0;
+    for (int i = 0; i < iterations; i++)
+        bins = fft_process(e);
+    clock_t c1 = clock();
+
+    memcpy(refL, e->fft->out_logL, bins * sizeof(float));
+    memcpy(refR, e->fft->out_logR, bins * sizeof(float));
+
+    clock_t c2 = clock();
+    size_t binsq = 0;
+    for (int i = 0; i < iterations; i++)
+        binsq = fftq_process(e);
+    clock_t c3 = clock();
+
+    float maxErr = 0.0f;
+    double sumErr = 0.0;
+    for (size_t i = 0; i < bins && i < binsq; i++)
+    {
+        float eL = fabsf(e->fft->out_logL[i] - refL[i]);
+        float eR = fabsf(e->fft->out_logR[i] - refR[i]);
+        if (eL > maxErr) maxErr = eL;
+        if (eR > maxErr) maxErr = eR;
+        sumErr += eL + eR;
+    }
+
+    free(refL);
+    free(refR);
+
+    cqt_init(e, CQ_BPO, CQ_FMIN, e->tapRate);
+    clock_t c4 = clock();
+    for (int i = 0; i < iterations; i++)
+        cqt_process(e);
+    clock_t c5 = clock();
+
+    clock_t c6 = clock();
+    for (int i = 0; i < iterations; i++)
+        mr_process(e);
+    clock_t c7 = clock();
+
+    // clock() is process CPU time, so the pooled path is timed on the wall
+    double w0 = wall_time();
+    for (int i = 0; i < iterations; i++)
+        ms_process(e);
+    double w1 = wall_time();
+
+    double msF = 1000.0 * (c1 - c0) / CLOCKS_PER_SEC / iterations;
+    double msQ = 1000.0 * (c3 - c2) / CLOCKS_PER_SEC / iterations;
+    double msC = 1000.0 * (c5 - c4) / CLOCKS_PER_SEC / iterations;
+    double msM = 1000.0 * (c7 - c6) / CLOCKS_PER_SEC / iterations;
+    double msS = 1000.0 * (w1 - w0) / iterations;
+
+    printf("INFO: BENCH N=%d, %d iterations, %zu bins\n", N, iterations, bins);
+    printf("INFO:\t  > float: %.3f ms/frame\n", msF);
+    printf("INFO:\t  > q15:   %.3f ms/frame (%.2fx)\n", msQ, (msQ > 0.0) ? msF / msQ : 0.0);
+    printf("INFO:\t  > q15 error vs float: max %.4f, mean %.5f\n", maxErr, sumErr / (2.0 * bins));
+    printf("INFO:\t  > cqt:   %.3f ms/frame (%zu bins)\n", msC, e->cq->bins);
+    printf("INFO:\t  > multirate: %.3f ms/frame (%d levels of %d points)\n", msM, MR_LEVELS, MR_N);
+    printf("INFO:\t  > multires: %.3f ms/frame wall (%d bands, %d threads)\n", msS, MS_BANDS, e->pool->threadCount + 1);
+
+    fft_bench_large(e);
+}
+
+static void spectrum_push(Engine *e, size_t bins, double t, size_t lag)
+{
+    // Overwrite the older of the two snapshots and make it the newest
+    int i = e->fft->snapHead ^ 1;
+    Spectrum_Snapshot *ss = &e->fft->snap[i];
+
+    memcpy(ss->logL, e->fft->out_logL, bins * sizeof(ss->logL[0]));
+    memcpy(ss->logR, e->fft->out_logR, bins * sizeof(ss->logR[0]));
+    ss->bins = bins;
+    ss->time = t;
+
+    // The newest sample the tap has is the last one of the newest block.
+    // That block was handed to the device at tapTime and starts playing once
+    // the output latency worth of audio ahead of it has drained. The window
+    // ends lag frames before it.
+    unsigned int block = atomic_load(&e->tapBlock);
+    ss->heardTime = atomic_load(&e->tapTime) + engine_output_latency(e) + ((double)block - (double)lag) / e->tapRate;
+
+    e->fft->snapHead = i;
+}
+
+float spectrum_alpha(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t)
+{
+    // Rendering trails analysis by one snapshot interval so that every
+    // displayed position lies between a and b. Anything out of order (seeks,
+    // track changes, pausing) just shows the newest snapshot.
+    double span = b->time - a->time;
+
+    if (span > 0.0 && a->bins == b->bins) {
+        double x = (t - span - a->time) / span;
+        return (x < 0.0) ? 0.0f : (x > 1.0) ? 1.0f : (float)x;
+    }
+
+    return 1.0f;
+}
+
+size_t spectrum_lerp(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, float *restrict outL, float *restrict outR)
+{
+    float alpha = spectrum_alpha(a, b, t);
+
+    // Straight-line loop over contiguous arrays so the compiler vectorizes it
+    size_t bins = b->bins;
+    for (size_t i = 0; i < bins; i++)
+    {
+        outL[i] = a->logL[i] + alpha * (b->logL[i] - a->logL[i]);
+        outR[i] = a->logR[i] + alpha * (b->logR[i] - a->logR[i]);
+    }
+
+    return bins;
+}
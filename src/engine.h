@@ -0,0 +1,92 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Analysis engine: audio tap, spectral analysis (FFT, Q15, constant-Q,
+// multirate, multi-resolution, sliding DFT) and the outline geometry the
+// visualizations are built from. Everything lives in an Engine context, so
+// any number of engines can run side by side in one process. Engines don't
+// know about raylib or any other front end.
+//
+// Threading: engine_push may run on an audio thread while another thread
+// calls the rest of the API on the same engine. Everything else on one
+// engine has to come from a single thread. engine_reset, engine_prime,
+// engine_cycle_pair and engine_set_mode change what engine_push writes to
+// and must not overlap it at all.
+
+// Samples in the analysis window, per channel
+#define ENGINE_N (1 << 14)
+
+// Most interleaved channels the audio tap keeps rings for (7.1)
+#define TAP_MAX_CHANNELS 8
+
+// Upper limit on bins tracked by the sliding DFT
+#define SDFT_MAX_BINS 128
+
+typedef enum
+{
+    ANALYSIS_FFT = 0,
+    ANALYSIS_CQT,
+    ANALYSIS_MULTIRATE,
+    ANALYSIS_MULTIRES,
+    ANALYSIS_COUNT
+} Analysis_Mode;
+
+typedef struct
+{
+    float logL[ENGINE_N / 2];
+    float logR[ENGINE_N / 2];
+    size_t bins;
+    double time;               // Playback position (seconds) the spectrum was taken at
+    double heardTime;          // Wall time (wall_time) the newest sample of its window leaves the speakers
+} Spectrum_Snapshot;
+
+typedef struct
+{
+    unsigned int sampleRate;    // Rate of the pushed frames, 0 for 48000
+    unsigned int channels;      // Interleaved channels per frame, 0 for stereo
+    bool useQ15;                // Fixed-point path for the plain FFT mode
+    const int *lowBins;         // FFT bins tracked by the sliding DFT, may be NULL
+    int lowBinCount;
+} Engine_Config;
+
+typedef struct Engine Engine;
+
+typedef void (*Pool_Job)(void *ctx, int job);
+
+Engine *engine_create(const Engine_Config *cfg);
+void engine_free(Engine *e);
+void engine_reset(Engine *e);
+void engine_push(Engine *e, const float *fs, unsigned int frames);
+void engine_prime(Engine *e, const float *fs, unsigned int frames);
+size_t engine_generation(const Engine *e);
+void engine_set_rate(Engine *e, unsigned int sampleRate);
+unsigned int engine_rate(const Engine *e);
+void engine_set_channels(Engine *e, unsigned int channels);
+void engine_cycle_pair(Engine *e);
+void engine_set_output_latency(Engine *e, double seconds);
+double engine_output_latency(const Engine *e);
+void engine_set_mode(Engine *e, Analysis_Mode mode);
+Analysis_Mode engine_mode(const Engine *e);
+size_t engine_analyze(Engine *e, double t);
+size_t engine_analyze_at(Engine *e, double t, size_t center);
+void engine_set_bands(Engine *e, size_t bands);
+size_t engine_band_of(const Engine *e, size_t bin);
+size_t engine_position(const Engine *e);
+size_t engine_playing(const Engine *e, double now);
+void engine_set_sync_offset(Engine *e, double seconds);
+double engine_sync_offset(const Engine *e);
+const Spectrum_Snapshot *engine_snapshot(const Engine *e, int age);
+size_t engine_low_bins(Engine *e, float *outL, float *outR);
+void engine_wave(const Engine *e, size_t end, float *left, float *right, size_t n);
+void engine_ring(const float *mag, size_t count, float low, float rest, float cx, float cy, float radius, float *xy);
+void engine_pool_run(Engine *e, Pool_Job fn, void *ctx, int count);
+// Also times the four-step FFT, which analysis only uses from ENGINE_N >= 1 << 16
+void engine_benchmark(Engine *e, int iterations);
+float spectrum_alpha(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t);
+size_t spectrum_lerp(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, float *restrict outL, float *restrict outR);
+double wall_time();
+
+#endif // ENGINE_H
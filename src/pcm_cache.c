@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "pcm_cache.h"
+
+#define PCM_PATH_MAX 1024
+
+_Static_assert(sizeof(Pcm_Header) == 64, "samples have to start 64 byte aligned");
+
+static void pcm_cache_file(char *out, const char *dir, uint64_t key);
+
+uint64_t pcm_cache_key(const char *path)
+{
+    // FNV-1a over the whole file, so a renamed or copied track still hits
+    // and an edited one (same path and size) doesn't. 0 if it can't be read.
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return 0;
+
+    uint64_t h = 14695981039346656037ULL;
+    unsigned char buf[1 << 16];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        for (size_t i = 0; i < n; i++)
+            h = (h ^ buf[i]) * 1099511628211ULL;
+
+    fclose(f);
+
+    return (h != 0) ? h : 1;
+}
+
+bool pcm_cache_store(const char *dir, uint64_t key, const int16_t *samples, size_t frames, unsigned int sampleRate, unsigned int channels)
+{
+    // Written under a temporary name and renamed into place, so a reader
+    // (or a crash) never sees a partial file
+    char path[PCM_PATH_MAX];
+    char tmp[PCM_PATH_MAX + 8];
+    pcm_cache_file(path, dir, key);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        printf("ERROR: PCM Could not create %s\n", tmp);
+        return false;
+    }
+
+    Pcm_Header hdr = {0};
+    memcpy(hdr.magic, PCM_MAGIC, sizeof(PCM_MAGIC));
+    hdr.version = PCM_VERSION;
+    hdr.sampleRate = sampleRate;
+    hdr.channels = channels;
+    hdr.frames = frames;
+    hdr.key = key;
+
+    size_t count = frames * channels;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(samples, sizeof(int16_t), count, f) == count;
+    ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp, path) == 0;
+#endif
+
+    if (!ok) {
+        printf("ERROR: PCM Could not write %s\n", path);
+        remove(tmp);
+    }
+
+    return ok;
+}
+
+Pcm_Map *pcm_cache_open(const char *dir, uint64_t key)
+{
+    // NULL when the track isn't cached (yet) or the file doesn't check out
+    char path[PCM_PATH_MAX];
+    pcm_cache_file(path, dir, key);
+
+    void *base = NULL;
+    size_t size = 0;
+    void *handle = NULL;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER len;
+    if (GetFileSizeEx(file, &len) && len.QuadPart >= (LONGLONG)sizeof(Pcm_Header)) {
+        size = (size_t)len.QuadPart;
+        handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (handle != NULL) base = MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    // The mapping keeps the file open
+    CloseHandle(file);
+    if (base == NULL) {
+        if (handle != NULL) CloseHandle(handle);
+        return NULL;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Pcm_Header)) {
+        size = (size_t)st.st_size;
+        base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    // The mapping keeps the file open
+    close(fd);
+    if (base == NULL || base == MAP_FAILED) return NULL;
+#endif
+
+    Pcm_Map *m = (Pcm_Map *)malloc(sizeof(Pcm_Map));
+    memset(m, 0, sizeof(Pcm_Map));
+    m->base = base;
+    m->size = size;
+    m->handle = handle;
+
+    const Pcm_Header *hdr = (const Pcm_Header *)base;
+    bool valid = memcmp(hdr->magic, PCM_MAGIC, sizeof(PCM_MAGIC)) == 0 && hdr->version == PCM_VERSION && hdr->key == key
+              && hdr->sampleRate > 0 && hdr->channels > 0
+              && hdr->frames <= (size - sizeof(Pcm_Header)) / (hdr->channels * sizeof(int16_t));
+
+    if (!valid) {
+        printf("ERROR: PCM %s is not a usable cache file\n", path);
+        pcm_cache_close(m);
+        return NULL;
+    }
+
+    m->samples = (const int16_t *)(hdr + 1);
+    m->frames = (size_t)hdr->frames;
+    m->sampleRate = hdr->sampleRate;
+    m->channels = hdr->channels;
+
+    return m;
+}
+
+bool pcm_cache_mkdir(const char *dir)
+{
+    // Fine if it exists already
+#ifdef _WIN32
+    return CreateDirectoryA(dir, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    struct stat st;
+    return mkdir(dir, 0755) == 0 || (stat(dir, &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+void pcm_cache_close(Pcm_Map *m)
+{
+    if (m == NULL) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(m->base);
+    CloseHandle(m->handle);
+#else
+    munmap(m->base, m->size);
+#endif
+    free(m);
+}
+
+void pcm_cache_file(char *out, const char *dir, uint64_t key)
+{
+    snprintf(out, PCM_PATH_MAX, "%s/%016llx.pcm", dir, (unsigned long long)key);
+}
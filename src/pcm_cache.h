@@ -0,0 +1,47 @@
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Decoded tracks kept on disk as interleaved int16 PCM, one file per track
+// named after a hash of the encoded file's contents. A cached track is
+// memory-mapped read-only, so playback and analysis read samples straight
+// from the page cache: any position is one pointer away and playing it
+// again costs no decoding.
+
+#define PCM_MAGIC "VISPCM1"
+#define PCM_VERSION 1
+
+// File header, the samples start right after it
+typedef struct
+{
+    char magic[8];              // PCM_MAGIC, zero padded
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint32_t reserved;
+    uint64_t frames;
+    uint64_t key;               // pcm_cache_key of the source file
+    uint8_t pad[24];            // Keeps the samples 64 byte aligned
+} Pcm_Header;
+
+typedef struct
+{
+    const int16_t *samples;     // Interleaved, frames * channels
+    size_t frames;
+    unsigned int sampleRate;
+    unsigned int channels;
+    void *base;                 // The whole mapping, header included
+    size_t size;
+    void *handle;               // File mapping object on Windows
+} Pcm_Map;
+
+bool pcm_cache_mkdir(const char *dir);
+uint64_t pcm_cache_key(const char *path);
+bool pcm_cache_store(const char *dir, uint64_t key, const int16_t *samples, size_t frames, unsigned int sampleRate, unsigned int channels);
+Pcm_Map *pcm_cache_open(const char *dir, uint64_t key);
+void pcm_cache_close(Pcm_Map *m);
+
+#endif // PCM_CACHE_H
@@ -0,0 +1,288 @@
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "spectrum_shm.h"
+
+#define SHM_NAME_MAX 128
+
+// The region is mapped by separately built processes, so whatever it holds
+// has to be lock-free (no hidden mutex living in one process only)
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs lock-free atomics");
+
+struct Shm_Publisher
+{
+    Shm_Region *region;
+    uint64_t frame;
+    char name[SHM_NAME_MAX];
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+struct Shm_Reader
+{
+    const Shm_Region *region;
+    uint64_t seen;              // Frame handed out by the last shm_reader_latest
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+static bool shm_name(char *out, const char *name);
+static double shm_now();
+
+Shm_Publisher *shm_publisher_create(const char *name)
+{
+    Shm_Publisher *pub = (Shm_Publisher *)malloc(sizeof(Shm_Publisher));
+    memset(pub, 0, sizeof(Shm_Publisher));
+
+    if (!shm_name(pub->name, name)) {
+        printf("ERROR: Invalid shared memory name '%s'\n", name);
+        free(pub);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    pub->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Shm_Region), pub->name);
+    if (pub->mapping != NULL)
+        pub->region = (Shm_Region *)MapViewOfFile(pub->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Shm_Region));
+    if (pub->region == NULL) {
+        printf("ERROR: Could not create shared memory '%s' (error %lu)\n", pub->name, GetLastError());
+        if (pub->mapping != NULL) CloseHandle(pub->mapping);
+        free(pub);
+        return NULL;
+    }
+#else
+    // A region left behind by a publisher that crashed is simply taken over
+    pub->fd = shm_open(pub->name, O_CREAT | O_RDWR, 0644);
+    void *p = MAP_FAILED;
+    if (pub->fd >= 0 && ftruncate(pub->fd, sizeof(Shm_Region)) == 0)
+        p = mmap(NULL, sizeof(Shm_Region), PROT_READ | PROT_WRITE, MAP_SHARED, pub->fd, 0);
+    if (p == MAP_FAILED) {
+        printf("ERROR: Could not create shared memory '%s'\n", pub->name);
+        if (pub->fd >= 0) {
+            close(pub->fd);
+            shm_unlink(pub->name);
+        }
+        free(pub);
+        return NULL;
+    }
+    pub->region = (Shm_Region *)p;
+#endif
+
+    // Readers check magic last, so they never see a half set up header
+    Shm_Region *r = pub->region;
+    atomic_store_explicit(&r->latest, 0, memory_order_relaxed);
+    for (int i = 0; i < SHM_SLOTS; i++)
+        atomic_store_explicit(&r->slot[i].seq, 0, memory_order_relaxed);
+    r->version = SHM_VERSION;
+    r->slots = SHM_SLOTS;
+    r->maxBins = ENGINE_N / 2;
+    atomic_thread_fence(memory_order_release);
+    r->magic = SHM_MAGIC;
+
+    printf("INFO: Publishing spectra to shared memory '%s' (%zu bytes)\n", pub->name, sizeof(Shm_Region));
+
+    return pub;
+}
+
+void shm_publisher_push(Shm_Publisher *pub, const Spectrum_Snapshot *s, Analysis_Mode mode, unsigned int sampleRate)
+{
+    // Slots are written round robin, so a reader copying one slot has
+    // SHM_SLOTS - 1 more publishes before the publisher comes back to it
+    Shm_Region *r = pub->region;
+    uint64_t frame = ++pub->frame;
+    Shm_Frame *f = &r->slot[frame % SHM_SLOTS];
+    uint32_t seq = atomic_load_explicit(&f->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&f->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t bins = (s->bins < ENGINE_N / 2) ? s->bins : ENGINE_N / 2;
+    f->bins = (uint32_t)bins;
+    f->mode = (uint32_t)mode;
+    f->sampleRate = sampleRate;
+    f->frame = frame;
+    f->time = s->time;
+    f->heardTime = s->heardTime;
+    f->publishTime = shm_now();
+    memcpy(f->logL, s->logL, bins * sizeof(float));
+    memcpy(f->logR, s->logR, bins * sizeof(float));
+
+    atomic_store_explicit(&f->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&r->latest, frame, memory_order_release);
+}
+
+void shm_publisher_free(Shm_Publisher *pub)
+{
+    if (pub == NULL) return;
+
+#ifdef _WIN32
+    // The mapping goes away with the last handle, readers included
+    UnmapViewOfFile(pub->region);
+    CloseHandle(pub->mapping);
+#else
+    // Readers that still have it mapped keep their view of the last frame
+    munmap(pub->region, sizeof(Shm_Region));
+    close(pub->fd);
+    shm_unlink(pub->name);
+#endif
+    free(pub);
+}
+
+Shm_Reader *shm_reader_open(const char *name)
+{
+    char path[SHM_NAME_MAX];
+    if (!shm_name(path, name)) {
+        printf("ERROR: Invalid shared memory name '%s'\n", name);
+        return NULL;
+    }
+
+    Shm_Reader *rd = (Shm_Reader *)malloc(sizeof(Shm_Reader));
+    memset(rd, 0, sizeof(Shm_Reader));
+
+#ifdef _WIN32
+    rd->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, path);
+    if (rd->mapping != NULL)
+        rd->region = (const Shm_Region *)MapViewOfFile(rd->mapping, FILE_MAP_READ, 0, 0, sizeof(Shm_Region));
+    if (rd->region == NULL) {
+        if (rd->mapping != NULL) CloseHandle(rd->mapping);
+        free(rd);
+        return NULL;
+    }
+#else
+    // The descriptor isn't needed once the region is mapped
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        free(rd);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(Shm_Region), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        free(rd);
+        return NULL;
+    }
+    rd->region = (const Shm_Region *)p;
+#endif
+
+    // A publisher built with a different layout (or still setting up) can't
+    // be read safely
+    const Shm_Region *r = rd->region;
+    if (r->magic != SHM_MAGIC || r->version != SHM_VERSION || r->slots != SHM_SLOTS || r->maxBins != ENGINE_N / 2) {
+        printf("ERROR: Shared memory '%s' has an incompatible layout\n", path);
+        shm_reader_close(rd);
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    return rd;
+}
+
+const Shm_Frame *shm_reader_begin(Shm_Reader *r, uint32_t *seq)
+{
+    // Newest complete slot for reading in place, or NULL if nothing has been
+    // published yet (or the slot is being rewritten right now). Whatever is
+    // read from it only counts once shm_reader_end agrees.
+    uint64_t frame = atomic_load_explicit(&r->region->latest, memory_order_acquire);
+    if (frame == 0) return NULL;
+
+    const Shm_Frame *f = &r->region->slot[frame % SHM_SLOTS];
+    *seq = atomic_load_explicit(&f->seq, memory_order_acquire);
+
+    return (*seq & 1) ? NULL : f;
+}
+
+bool shm_reader_end(Shm_Reader *r, const Shm_Frame *f, uint32_t seq)
+{
+    // False if the publisher started rewriting the slot since shm_reader_begin
+    (void)r;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&f->seq, memory_order_relaxed) == seq;
+}
+
+uint64_t shm_reader_latest(Shm_Reader *r, Shm_Frame *out)
+{
+    // Copies the newest frame into out if it wasn't handed out before.
+    // Returns its frame number, or 0 if there is nothing new.
+    for (int attempt = 0; attempt < 64; attempt++)
+    {
+        uint32_t seq;
+        const Shm_Frame *f = shm_reader_begin(r, &seq);
+        if (f == NULL) {
+            if (atomic_load_explicit(&r->region->latest, memory_order_relaxed) == 0) return 0;
+            continue;
+        }
+
+        uint64_t frame = f->frame;
+        if (frame == r->seen) return 0;
+
+        uint32_t bins = f->bins;
+        if (bins > ENGINE_N / 2) continue;
+
+        out->bins = bins;
+        out->mode = f->mode;
+        out->sampleRate = f->sampleRate;
+        out->frame = frame;
+        out->time = f->time;
+        out->heardTime = f->heardTime;
+        out->publishTime = f->publishTime;
+        memcpy(out->logL, f->logL, bins * sizeof(float));
+        memcpy(out->logR, f->logR, bins * sizeof(float));
+
+        if (shm_reader_end(r, f, seq)) {
+            atomic_store_explicit(&out->seq, seq, memory_order_relaxed);
+            r->seen = frame;
+            return frame;
+        }
+    }
+
+    // Only a publisher lapping the whole ring over and over ends up here
+    return 0;
+}
+
+void shm_reader_close(Shm_Reader *r)
+{
+    if (r == NULL) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(r->region);
+    CloseHandle(r->mapping);
+#else
+    munmap((void *)r->region, sizeof(Shm_Region));
+#endif
+    free(r);
+}
+
+bool shm_name(char *out, const char *name)
+{
+    // POSIX wants a single leading slash, Windows a session local name
+    if (name == NULL || name[0] == '\0' || strchr(name + 1, '/') != NULL || strchr(name, '\\') != NULL) return false;
+    if (name[0] == '/') name++;
+
+#ifdef _WIN32
+    int n = snprintf(out, SHM_NAME_MAX, "Local\\%s", name);
+#else
+    int n = snprintf(out, SHM_NAME_MAX, "/%s", name);
+#endif
+
+    return n > 1 && n < SHM_NAME_MAX;
+}
+
+double shm_now()
+{
+    // Same clock as wall_time(), without pulling in the engine
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,57 @@
+#ifndef SPECTRUM_SHM_H
+#define SPECTRUM_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "engine.h"
+
+// Spectrum frames published into shared memory for other local processes.
+// One publisher writes every finished spectrum into a small ring of slots,
+// each guarded by a seqlock; any number of readers map the same region
+// read-only and pick up the newest slot with plain loads, no syscalls and no
+// locks after shm_reader_open. The publisher never waits for readers: a
+// reader that is overtaken mid-copy notices and retries.
+
+#define SHM_MAGIC 0x4d505356u       // "VSPM"
+#define SHM_VERSION 1
+#define SHM_SLOTS 4
+
+typedef struct
+{
+    _Atomic uint32_t seq;           // Odd while the publisher is writing the slot
+    uint32_t bins;
+    uint32_t mode;                  // Analysis_Mode the spectrum was taken with
+    uint32_t sampleRate;
+    uint64_t frame;                 // Publish counter, 1 for the first frame
+    double time;                    // Playback position (seconds)
+    double heardTime;               // Wall time the newest sample of the window is heard
+    double publishTime;             // Wall time the frame was published
+    float logL[ENGINE_N / 2] __attribute__((aligned(64)));
+    float logR[ENGINE_N / 2];
+} Shm_Frame;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t maxBins;
+    _Atomic uint64_t latest;        // frame of the newest complete slot, 0 before the first
+    Shm_Frame slot[SHM_SLOTS] __attribute__((aligned(64)));
+} Shm_Region;
+
+typedef struct Shm_Publisher Shm_Publisher;
+typedef struct Shm_Reader Shm_Reader;
+
+Shm_Publisher *shm_publisher_create(const char *name);
+void shm_publisher_push(Shm_Publisher *pub, const Spectrum_Snapshot *s, Analysis_Mode mode, unsigned int sampleRate);
+void shm_publisher_free(Shm_Publisher *pub);
+
+Shm_Reader *shm_reader_open(const char *name);
+uint64_t shm_reader_latest(Shm_Reader *r, Shm_Frame *out);
+const Shm_Frame *shm_reader_begin(Shm_Reader *r, uint32_t *seq);
+bool shm_reader_end(Shm_Reader *r, const Shm_Frame *f, uint32_t seq);
+void shm_reader_close(Shm_Reader *r);
+
+#endif // SPECTRUM_SHM_H
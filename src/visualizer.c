@@ -1,99 +1,566 @@
 #include <time.h>
 #include <math.h>
-#include <complex.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#else
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "raylib.h"
 
 #include "raylib.h"
+#include "engine.h"
+#include "spectrum_shm.h"
+#include "pcm_cache.h"
 
 #define GLSL_VERSION 330
 
-#define N (1 << 14)
+#define N ENGINE_N
 #define SB (1 << 10)
 
-#define VB 100 
+// Share of the fft_visualize2 trail that fades out every analysis tick of
+// playback. Older outlines live on in a feedback texture instead of being
+// redrawn.
+#define TRAIL_FADE 0.06f
+
+// Highest FFT bin on the outer ring of fft_visualize2, about 1.9 kHz at
+// 48 kHz, wherever it falls in the band layout
+#define RING_TOP_BIN 640
+
+// Spectrogram waterfall: analysis frames of history (one texture column
+// each, used as a ring) and frequency rows per column
+#define SPECTRO_W 1024
+#define SPECTRO_H 512
+
+// Lowest frequency (Hz) on the spectrogram axis of the FFT bin modes, where
+// the constant-Q bins start too
+#define SPECTRO_FMIN 27.5f
+
+// Continuous audio (seconds) the device rate is measured over before it is
+// handed to the engine
+#define RATE_PROBE_SECONDS 1.0
+
+// Rate (in playback seconds) at which new spectra are analyzed. Rendering runs at
+// the monitor rate and interpolates between the two most recent analysis frames.
+#define ANALYSIS_HZ 60.0
+
+// Longest the smoothed playback clock runs on with the wall clock while the
+// music position stands still. It only moves once per stream sub-buffer.
+#define CLOCK_HOLD 0.1
+
+// Horizontal bands the software rasterizer splits a frame into, each band
+// rasterizes every recorded command clipped to its rows
+#define SOFT_BANDS 16
+
+// Frames the recorder can hold between the render loop and the encoder pipe
+#define REC_QUEUE 8
+
+// raudio's MusicContextType (raylib 4.5): decoders behind Music.ctxData
+#define MUSIC_CTX_WAV 1
+#define MUSIC_CTX_OGG 2
+#define MUSIC_CTX_MP3 4
+
+// Tracklist storage: tracks live in pages that never move once allocated,
+// so the background workers can hold on to a track while more are added
+#define TRACK_PAGE 1024
+#define TRACK_PAGES 128
+
+// Tags and durations of every track seen so far, read on startup. Kept in
+// the PCM cache directory when there is one, else next to the executable.
+#define METADATA_CACHE "metadata.cache"
+
+// Audio tap traces: file signature, and bytes buffered between the audio
+// thread and the trace writer (about 10 s of 48 kHz stereo, power of two)
+#define TRACE_MAGIC "VISTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING (1 << 22)
 
 typedef struct
 {
     char *file_path;
+    char *title;                // Tags, NULL when the file has none. Owned by meta.
+    char *artist;
+    char *album;
+    float length;               // Seconds, 0 if unknown
+    atomic_bool hasMeta;        // Set by the metadata worker once the fields above are filled
+    uint64_t pcmKey;            // Content hash naming the decoded copy in the PCM cache
+    atomic_bool hasPcm;         // Set by the PCM worker once that copy is complete
 } Track;
 
+// Tags and duration of one file as kept in the on-disk cache
+typedef struct
+{
+    char *path;
+    int64_t mtime;
+    int64_t size;
+    float length;
+    char *title;
+    char *artist;
+    char *album;
+} Meta_Entry;
+
+// Extracts metadata for every track added to the tracklist on a background
+// thread, consulting a persistent cache keyed by path + mtime first
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool quit;
+    size_t next;                // Next track index to look at
+    Meta_Entry *entries;
+    size_t count;
+    size_t cap;
+    uint32_t *index;            // Open addressing on the path hash, entry + 1, 0 is empty
+    size_t indexCap;
+    char **retired;             // Tag strings of replaced entries, tracks may still show them
+    size_t retiredCount;
+    size_t retiredCap;
+    char file[1024];            // Where the cache is read from and written to
+    bool dirty;                 // Entries changed since the cache file was read
+    size_t hits;
+    size_t parsed;
+} Meta_Store;
+
+// Decodes every track added to the tracklist once, on a background thread,
+// into the PCM cache (--pcm-cache <dir>)
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool quit;
+    const char *dir;
+    size_t next;                // Next track index to look at
+    size_t count;               // Tracks added so far
+    size_t hits;
+    size_t decoded;
+} Pcm_Worker;
+
 typedef struct
 {
     size_t count;
     int currIdx;
     Music current;
-    Track tracks[100];
+    Pcm_Map *pcm;               // Decoded copy of the current track when cached, played instead of current
+    AudioStream pcmStream;
+    atomic_size_t pcmPos;       // Next frame of pcm the stream callback reads
+    Track *pages[TRACK_PAGES];  // Track i is pages[i / TRACK_PAGE][i % TRACK_PAGE]
 } TrackList;
 
+typedef enum
+{
+    GFX_LINE = 0,
+    GFX_RECT_GRADIENT_V,
+    GFX_CIRCLE,
+    GFX_IMAGE_ADD,
+    GFX_IMAGE_SCROLL,
+} Gfx_Kind;
+
+typedef struct
+{
+    Gfx_Kind kind;
+    Vector2 a;                  // Line start, rect top left, circle center
+    Vector2 b;                  // Line end, rect size, (radius, 0) for circles
+    float thick;
+    Color c0;                   // Color, top color for gradients
+    Color c1;                   // Bottom color for gradients
+    const Color *src;           // Pixels added onto the target, same size as it
+    int srcW;                   // Scrolled image: size of src, and the column
+    int srcH;                   // shown at the left edge (wrapping around)
+    int srcX;
+} Gfx_Cmd;
+
+// CPU render target for the gfx_* draw calls. Commands are recorded during
+// the frame and rasterized on soft_flush, band by band, so bands can run on
+// the worker pool without sharing any pixels.
+typedef struct
+{
+    int w;
+    int h;
+    Color *px;                  // RGBA8, same layout as a raylib Image
+    Color clear;
+    float fade;                 // When set the old contents fade by this much instead of clearing
+    Gfx_Cmd *cmd;
+    size_t count;
+    size_t cap;
+    bool threaded;
+} Soft_Canvas;
+
+// Streams raw RGBA frames into an encoder process. The render loop only
+// hands frames over through a bounded queue, a writer thread feeds the pipe.
+typedef struct
+{
+    FILE *pipe;
+    intptr_t encoder;           // Encoder process: pid, or process handle on Windows
+    int w;
+    int h;
+    double fps;
+    double start;               // Wall time of the first frame
+    Color *slot[REC_QUEUE];     // Queued frames, owned by the queue
+    int repeat[REC_QUEUE];      // Times each frame is written (frame pacing)
+    size_t head;                // Next slot the writer takes
+    size_t tail;                // Next slot the render loop fills
+    size_t framesDue;           // Video frames accounted for so far
+    int owed;                   // Repeats of dropped frames, added to the next one
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    bool quit;
+    bool broken;                // Encoder went away, frames are discarded
+    size_t pushed;
+    size_t dropped;
+    size_t written;
+    double captureSum;          // Time the render loop spent on readback + enqueue
+    double captureMax;
+    double writeSum;            // Time the writer spent blocked on the encoder
+} Recorder;
+
+// Song info text rasterized once per track into a texture, drawn as a
+// single quad every frame
+typedef struct
+{
+    const char *path;           // Track the texture was built for
+    float length;               // Its duration, in seconds
+    bool hasMeta;               // Whether its tags were known yet
+    Image img;
+    Texture2D tex;
+} Text_Cache;
+
+// Audio to display latency of the frames shown: how long after a sample
+// left the speakers the spectrum ending at it reached the screen. Shown per
+// one second window, plus totals for the whole run.
 typedef struct
 {
-    float complex in_rawL[N];  // Raw data from audio stream buffer
-    float complex in_hannL[N]; // Data with hann function applied
-    float complex out_rawL[N];
-    float out_logL[N];
+    double windowStart;
+    double sum;                 // Current window
+    double min;
+    double max;
+    size_t count;
+    double avg;                 // Last complete window, what the overlay shows
+    double lo;
+    double hi;
+    size_t frames;
+    double totalSum;
+    double totalMin;
+    double totalMax;
+    size_t total;
+} Latency_Stats;
+
+// Self-test signal: a click every period frames, generated on the audio
+// thread. The tap notes when each click will be heard, the render loop
+// matches that against the frame where the onset shows up.
+typedef struct
+{
+    unsigned int rate;
+    size_t frame;               // Generator position
+    size_t period;
+    bool inClick;               // Tap side, the last sample was part of a click
+    _Atomic double heard;       // When the newest unmatched click leaves the speakers, 0 if none
+} Click_Track;
+
+// Measures the rate the device actually runs at from the frames the tap
+// gets over wall time. raylib 4.5 opens the device at its default rate and
+// has no call to ask for it.
+typedef struct
+{
+    double last;                // Wall time of the previous buffer, 0 for none
+    double elapsed;             // Continuous run measured so far
+    size_t frames;
+    atomic_uint rate;           // Measured rate once known, 0 before
+} Rate_Probe;
+
+// Trace file layout: one header, then for every buffer the audio device
+// handed fft_callback a block header followed by its interleaved float
+// frames, bit for bit
+typedef struct
+{
+    char magic[8];              // TRACE_MAGIC, not terminated
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint32_t reserved;
+} Trace_Header;
 
-    float complex in_rawR[N];  // Raw data from audio stream buffer
-    float complex in_hannR[N]; // Data with hann function applied
-    float complex out_rawR[N];
-    float out_logR[N];
-} FFT_Analyzer;
+typedef struct
+{
+    double time;                // Seconds since recording started, at the callback
+    uint32_t frames;
+    uint32_t dropped;           // Buffers lost right before this one (ring full)
+} Trace_Block;
 
+// Records the audio tap to a trace file. The audio thread only copies
+// into a lock-free ring, a writer thread drains it to disk.
 typedef struct
 {
-    float complex right[SB];
-    float complex left[SB];
-} Audio_Buffer;
+    FILE *file;
+    unsigned int channels;
+    double start;
+    unsigned char *ring;        // TRACE_RING bytes
+    atomic_size_t head;         // Bytes written to the file so far
+    atomic_size_t tail;         // Bytes queued by the audio thread so far
+    pthread_t thread;
+    pthread_mutex_t lock;       // Only for the writer's timed wait
+    pthread_cond_t wake;
+    atomic_bool quit;
+    bool broken;
+    size_t blocks;              // Audio thread side counters
+    size_t frames;
+    size_t dropped;
+    uint32_t lost;              // Dropped since the last queued block
+} Trace_Writer;
 
 typedef struct 
 {
-    Vector2 out[VB][N];
-    Vector2 out2[VB][N];
-    Color col[VB];
-    Color col2[VB];
+    Vector2 out[N];             // Newest outer outline
+    Vector2 out2[N];            // Newest inner outline
+    size_t outCount;
+    size_t out2Count;
+    Color col;
+    Color col2;
+    Vector2 barBase[N / 2];     // Bar feet on the center line, laid out per size
+    Color barL;                 // Bar colors before the amplitude alpha
+    Color barR;
+    float barD;                 // Bar width and spacing
+    size_t barCount;
+    int barW;                   // Size and band count the bars were laid out for
+    int barH;
+    RenderTexture2D trail;      // Faded history of both outlines
+    double trailTime;           // Playback time the trail was last moved on to
+    Soft_Canvas *trailSoft;     // Same, when rendering in software
+    Texture2D spectro;          // Waterfall ring, SPECTRO_W x SPECTRO_H
+    Color *spectroSoft;         // Same, when rendering in software
+    int spectroHead;            // Column the next analysis frame goes into, the oldest one
+    Color spectroColumn[SPECTRO_H];
+    Color spectroPalette[256];
 } Visualizer;
 
-Audio_Buffer *aBuff = NULL;
+Engine *engine = NULL;
 
 Visualizer *vis = NULL;
 
-FFT_Analyzer *fft = NULL;
-
 TrackList *tl = NULL;
+Meta_Store *meta = NULL;
+Pcm_Worker *pcmWorker = NULL;
+
+// Directory of the PCM cache, NULL to always decode while playing
+const char *pcmDir = NULL;
+
+// Bumped by the metadata and PCM workers whenever a track's results are
+// published, so the main loop knows to redraw
+atomic_size_t workerResults = 0;
+
+// When set, every gfx_* call is recorded for the software rasterizer instead
+// of going to raylib (headless rendering)
+Soft_Canvas *gfxSoft = NULL;
+
+Text_Cache *songText = NULL;
+
+Click_Track clickTrack = {0};
+
+Rate_Probe rateProbe = {0};
+
+// Set while --trace-record is capturing the tap
+Trace_Writer *trace = NULL;
+
+// Stream position (frame count at the tap) the visuals show: the sample
+// playing right now live, the current position when rendering offline
+size_t viewPos = 0;
 
 void fft_callback(void *bufferData, unsigned int frames);
+void rate_probe_tap(Rate_Probe *rp, unsigned int frames);
+bool audio_sync();
+void worker_notify();
+// rlgl (compiled into raylib, header not shipped): custom blend factors, for
+// fading the GPU trail by a fixed step
+#define RL_ONE 1
+#define RL_FUNC_REVERSE_SUBTRACT 0x800B
+void rlSetBlendFactors(int glSrcFactor, int glDstFactor, int glEquation);
+
+// GLFW (compiled into raylib): wakes a main loop blocked in event waiting,
+// callable from any thread
+void glfwPostEmptyEvent(void);
+
+// Decoders compiled into raylib, driven directly on a Music context to
+// decode the window before a seek target
+unsigned long long drwav_read_pcm_frames_f32(void *wav, unsigned long long frames, float *out);
+unsigned int drwav_seek_to_pcm_frame(void *wav, unsigned long long frame);
+unsigned long long drmp3_read_pcm_frames_f32(void *mp3, unsigned long long frames, float *out);
+unsigned int drmp3_seek_to_pcm_frame(void *mp3, unsigned long long frame);
+int stb_vorbis_seek(void *f, unsigned int sample);
+int stb_vorbis_get_samples_float_interleaved(void *f, int channels, float *buffer, int num_floats);
+
 bool isExtensionValid(const char *s);
 void tracklist_init();
-void tracklist_add(char* s);
+bool tracklist_add(char* s);
+Track *tracklist_at(size_t i);
 void tracklist_free();
-void audioBuff_clean();
+void meta_init();
+void meta_free();
+void *meta_worker(void *arg);
+uint32_t meta_hash(const char *s);
+Meta_Entry *meta_find(const char *path);
+Meta_Entry *meta_insert(const char *path, const Meta_Entry *src);
+void meta_retire(char *s);
+void meta_write_field(FILE *f, const char *s);
+void meta_unescape(char *s);
+void meta_load(const char *file);
+void meta_save(const char *file);
+char *meta_text(const uint8_t *p, size_t n, int enc);
+void meta_parse(const char *path, Meta_Entry *e);
+void meta_parse_mp3(FILE *f, Meta_Entry *e);
+void meta_parse_ogg(FILE *f, Meta_Entry *e);
+void meta_parse_wav(FILE *f, Meta_Entry *e);
 void tracklist_play(int i);
-void audioBuff_init();
+void tracklist_seek(float position);
+float tracklist_time();
+float tracklist_length();
+bool tracklist_playing();
+void tracklist_pause(bool pause);
+void tracklist_update();
+void tracklist_hold(bool hold);
+void pcm_init(const char *dir);
+void pcm_free();
+void *pcm_worker(void *arg);
+void pcm_callback(void *bufferData, unsigned int frames);
+void audioBuff_init(unsigned int sampleRate, unsigned int channels);
 void audioBuff_free();
-void _fft(float complex in[], float complex out[], int n, int step);
-size_t fft_process();
-void fft_visualize(size_t frames, int w, int h);
-void fft_visualize2(size_t frames, int w, int h);
+void fft_bars_layout(size_t frames, int w, int h);
+void fft_visualize(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, int w, int h);
+void trail_update(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, int w, int h);
+void fft_visualize2(int w, int h);
+void spectro_update(const Spectrum_Snapshot *s);
+void spectro_draw(int w, int h);
 void drawWave(int w, int h);
 void drawSongInfo(int w, int h);
+void text_cache_build(const Track *track, float length, bool hasMeta);
+void text_cache_free();
+void drawScene(double t, int w, int h, bool showWave, bool showFFT, bool showFFT2, bool showSpectro, bool isMusicLoaded);
+void view_select(size_t v, bool *showWave, bool *showFFT, bool *showFFT2, bool *showSpectro);
+void gfx_line(Vector2 a, Vector2 b, float thick, Color c);
+void gfx_line_strip(const Vector2 *pts, int n, Color c);
+void gfx_rect_gradient_v(int x, int y, int w, int h, Color top, Color bottom);
+void gfx_circle(int cx, int cy, float r, Color c);
+Soft_Canvas *soft_create(int w, int h, bool threaded);
+void soft_free(Soft_Canvas *sc);
+void soft_begin(Soft_Canvas *sc, Color clear);
+void soft_push(Gfx_Cmd cmd);
+void soft_blend(Color *d, Color c, float cov);
+void soft_span(Color *d, int n, Color c);
+void soft_raster_line(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1);
+void soft_raster_rect(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1);
+void soft_raster_circle(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1);
+void soft_raster_image_add(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1);
+void soft_raster_image_scroll(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1);
+void soft_band_job(void *ctx, int job);
+void soft_flush(Soft_Canvas *sc);
+void gfx_trail_begin(int w, int h, float fade, int step);
+void gfx_trail_end();
+void gfx_trail_draw();
+int headless_run(const char *path, const char *prefix, size_t view);
+Recorder *recorder_start(const char *path, int w, int h, double fps, const char *audio, double audioOffset, bool flip);
+FILE *encoder_spawn(const char **argv, intptr_t *proc);
+void encoder_close(FILE *pipe, intptr_t proc);
+void *recorder_writer(void *arg);
+bool recorder_push(Recorder *rec, Color *px, int repeat, bool block);
+void recorder_capture(Recorder *rec, Texture2D tex);
+void recorder_stop(Recorder *rec);
+void sceneCache_present(RenderTexture2D cache, int w, int h);
+void latency_add(Latency_Stats *ls, double now, double lag);
+double latency_displayed(double t, double now);
+void latency_draw(const Latency_Stats *ls, int h);
+void latency_report(const Latency_Stats *ls, const char *what);
+void click_generate(void *bufferData, unsigned int frames);
+void click_tap(void *bufferData, unsigned int frames);
+int latency_test(int clicks);
+Trace_Writer *trace_start(const char *path, unsigned int sampleRate, unsigned int channels);
+void trace_tap(Trace_Writer *tw, const float *fs, unsigned int frames);
+void *trace_writer(void *arg);
+void trace_stop(Trace_Writer *tw);
+int trace_replay(const char *path, const char *prefix, size_t view);
 bool handleFileDrop(bool *isPaused);
 
-int main()
+int main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        audioBuff_init(48000, 2);
+        engine_benchmark(engine, 100);
+        audioBuff_free();
+        return 0;
+    }
+
+    // --headless <track> <output prefix> [view]: render every analysis frame
+    // of a track with the software rasterizer into numbered PNGs, no window,
+    // GPU or audio device needed
+    if (argc > 3 && strcmp(argv[1], "--headless") == 0) {
+        return headless_run(argv[2], argv[3], (argc > 4) ? (size_t)atoi(argv[4]) : 0);
+    }
+
+    // --latency-test [clicks]: play a click track through the tap and time
+    // each click from the speakers to its onset on screen
+    if (argc > 1 && strcmp(argv[1], "--latency-test") == 0) {
+        return latency_test((argc > 2) ? atoi(argv[2]) : 20);
+    }
+
+    // --trace-replay <trace> [view] [output prefix]: feed a recorded tap
+    // trace through analysis and the software renderer, timing both; the
+    // same trace gives the same spectra (and checksum) on every run
+    if (argc > 2 && strcmp(argv[1], "--trace-replay") == 0) {
+        return trace_replay(argv[2], (argc > 4) ? argv[4] : NULL, (argc > 3) ? (size_t)atoi(argv[3]) : 0);
+    }
 
     SetConfigFlags(FLAG_MSAA_4X_HINT);
 
     InitWindow(1024, 900, "Music Visualizer");
-    SetTargetFPS(60);
+
+    // Render at the monitor's rate, analysis runs at ANALYSIS_HZ regardless
+    int refresh = GetMonitorRefreshRate(GetCurrentMonitor());
+    SetTargetFPS((refresh > 0) ? refresh : 60);
     SetWindowState(FLAG_WINDOW_RESIZABLE);
     SetWindowMinSize(1024,900);
 
     //Shader shader = LoadShader(0, TextFormat("./shaders/glsl%i/circle.fs", GLSL_VERSION));
 
-    audioBuff_init();
+    // raylib mixes every stream into the device format (AUDIO_DEVICE_CHANNELS)
+    // at the device rate before stream processors see it
+    audioBuff_init(48000, 2);
+
+    // --av-offset <ms> holds the visuals back (or, negative, ahead) on top of
+    // the estimated output latency; [ and ] adjust it while running.
+    // --publish <name> makes every analyzed spectrum available to other local
+    // processes through shared memory (see spectrum_shm.h).
+    // --trace-record <file> saves everything the tap gets for --trace-replay.
+    // --pcm-cache <dir> decodes every track once and plays it from there.
+    Shm_Publisher *publisher = NULL;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--av-offset") == 0)
+            engine_set_sync_offset(engine, atof(argv[i + 1]) / 1000.0);
+        else if (strcmp(argv[i], "--publish") == 0 && publisher == NULL)
+            publisher = shm_publisher_create(argv[i + 1]);
+        else if (strcmp(argv[i], "--trace-record") == 0 && trace == NULL)
+            trace = trace_start(argv[i + 1], 48000, 2);
+        else if (strcmp(argv[i], "--pcm-cache") == 0)
+            pcmDir = argv[i + 1];
+    }
     tracklist_init();
     InitAudioDevice();
 
@@ -105,56 +572,67 @@ int main()
     bool showWave = true;
     bool showFFT = true;
     bool showFFT2 = false;
+    bool showSpectro = false;
 
     bool isPaused = true;
     bool isMusicLoaded = false;
 
+    // Dirty tracking: drawing only happens when the tap delivered new
+    // samples, playback moved on or the view changed. Otherwise the last
+    // frame is presented from sceneCache, which is filled lazily on the first
+    // clean frame so normal playback keeps drawing straight to the (MSAA)
+    // backbuffer.
+    size_t lastGen = 0;
+    size_t lastResults = 0;
+    size_t analyzedGen = 0;
+    double analyzedT = 0.0;     // Playback time of the newest analysis
+    double nextTick = 0.0;      // Next ANALYSIS_HZ tick of playback time
+    bool analyzeNow = true;     // Something changed what the analysis yields
+    bool sceneDirty = true;
+    bool sceneCached = false;
+    bool isIdle = false;
+    RenderTexture2D sceneCache = LoadRenderTexture(GetRenderWidth(), GetRenderHeight());
+
+    // Render width the engine's display bands were laid out for
+    int layoutW = 0;
+
+    // Smoothed playback clock. tracklist_time() only advances once per
+    // device period, so it is extrapolated with the wall clock in between.
+    double playT = 0.0;
+    double clockMusic = 0.0;
+    double clockWall = 0.0;
+
+    // KEY_R toggles recording of what is on screen (plus the current track)
+    Recorder *rec = NULL;
+
+    // KEY_L toggles the audio to display latency overlay
+    Latency_Stats lat = {0};
+    bool showLatency = false;
+
     while (!WindowShouldClose())
     {
         int w = GetRenderWidth();
         int h = GetRenderHeight();
+        size_t gen = engine_generation(engine);
 
         // Handle Key Press
         int key = GetKeyPressed();
         switch (key)
         {
             case KEY_Q:
-                vis = (vis+1) % 4;
-
-                switch(vis)
-                {
-                    case 0:
-                        showWave = true;
-                        showFFT = true;
-                        showFFT2 = false;
-                        break;
-                    case 1:
-                        showFFT = true;
-                        showWave = false;
-                        break;
-                    case 2:
-                        showFFT = false;
-                        showWave = true;
-                        break;
-                    case 3:
-                        showWave = false;
-                        showFFT2 = true;
-                        break;
-                    default:
-                        break;
-                }
-
+                vis = (vis+1) % 5;
+                view_select(vis, &showWave, &showFFT, &showFFT2, &showSpectro);
                 break;
             case KEY_A:
                 if (tl->count > 0)
-                    SeekMusicStream(tl->current, (GetMusicTimePlayed(tl->current) - 5.0f));
+                    tracklist_seek(tracklist_time() - 5.0f);
                 break;
             case KEY_S:
                 if (tl->count > 0)
-                    SeekMusicStream(tl->current, (GetMusicTimePlayed(tl->current) + 60.0f));
+                    tracklist_seek(tracklist_time() + 60.0f);
                 break;
             case KEY_P:
-                (isPaused) ? ResumeMusicStream(tl->current) : PauseMusicStream(tl->current);
+                tracklist_pause(!isPaused);
                 isPaused = !isPaused;
                 break;
             case KEY_X:
@@ -165,79 +643,211 @@ int main()
                 if (tl->count > 0)
                     tracklist_play(tl->currIdx-1);
                 break;
+            case KEY_C:
+                // The multirate chain is fed by engine_push once selected
+                tracklist_hold(true);
+                engine_set_mode(engine, (engine_mode(engine) + 1) % ANALYSIS_COUNT);
+                tracklist_hold(false);
+                analyzeNow = true;
+                break;
+            case KEY_V:
+                // Starts the engine over, nothing may be pushed meanwhile
+                tracklist_hold(true);
+                engine_cycle_pair(engine);
+                tracklist_hold(false);
+                break;
+            case KEY_L:
+                showLatency = !showLatency;
+                break;
+            case KEY_LEFT_BRACKET:
+            case KEY_RIGHT_BRACKET:
+                engine_set_sync_offset(engine, engine_sync_offset(engine) + ((key == KEY_LEFT_BRACKET) ? -0.005 : 0.005));
+                printf("INFO: A/V offset %+.0f ms\n", 1000.0 * engine_sync_offset(engine));
+                analyzeNow = true;
+                break;
+            case KEY_R:
+                if (rec != NULL) {
+                    recorder_stop(rec);
+                    rec = NULL;
+                } else {
+                    const char *audio = (isMusicLoaded) ? tracklist_at(tl->currIdx)->file_path : NULL;
+                    double offset = (isMusicLoaded) ? tracklist_time() : 0.0;
+                    rec = recorder_start(TextFormat("capture_%ld.mp4", (long)time(NULL)), w, h, GetFPS() > 0 ? GetFPS() : 60, audio, offset, true);
+                }
+                break;
             default:
                 break;
         }
 
+        if (key != 0) sceneDirty = true;
+
         if (IsFileDropped()) {
             isMusicLoaded = handleFileDrop(&isPaused);
+            sceneDirty = true;
         }
 
-        BeginDrawing();
+        if (IsWindowResized()) {
+            // The encoder was opened for a fixed frame size
+            if (rec != NULL) {
+                recorder_stop(rec);
+                rec = NULL;
+            }
 
-            ClearBackground(BLACK);
+            UnloadRenderTexture(sceneCache);
+            sceneCache = LoadRenderTexture(w, h);
+            sceneDirty = true;
+        }
 
-            if (isMusicLoaded && IsMusicStreamPlaying(tl->current)) {
-                UpdateMusicStream(tl->current);
-            }
+        if (isMusicLoaded) {
+            tracklist_update();
+        }
+
+        // Device rate measured: the engine has to know what it is analyzing
+        if (audio_sync()) {
+            analyzeNow = true;
+            sceneDirty = true;
+        }
 
-            if (showWave)
-                drawWave(w, h/2);
+        if (gen != lastGen) {
+            lastGen = gen;
+            sceneDirty = true;
+        }
 
-            size_t frames = 0;
-            if (showFFT || showFFT2)
-                frames = fft_process();
+        // Tags or a decoded copy arrived from a worker
+        size_t results = atomic_load(&workerResults);
+        if (results != lastResults) {
+            lastResults = results;
+            sceneDirty = true;
+        }
 
-            if (showFFT)
-            {
-                fft_visualize(frames, w, h/2);
+        if (isMusicLoaded) {
+            double musicT = tracklist_time();
+            double now = GetTime();
+
+            if (musicT != clockMusic || isPaused) {
+                clockMusic = musicT;
+                clockWall = now;
             }
-            
 
-            if (showFFT2)
-            {
-                //BeginShaderMode(shader);
-                    fft_visualize2(frames, w, h);
-                //EndShaderMode();
+            double t = (isPaused) ? clockMusic : clockMusic + fmin(now - clockWall, CLOCK_HOLD);
+            if (t != playT) {
+                playT = t;
+                sceneDirty = true;
             }
+        }
+
+        // One display band per pixel column, laid out again only on resize
+        if (w != layoutW) {
+            engine_set_bands(engine, w);
+            layoutW = w;
+            analyzeNow = true;
+            sceneDirty = true;
+        }
+
+        // The tap runs ahead of the speakers by the output latency, so the
+        // visuals follow the sample estimated to be playing now instead
+        viewPos = engine_playing(engine, wall_time());
+
+        // Analyze on the ANALYSIS_HZ clock of playback rather than per tap
+        // block, so the window follows the playing sample between blocks
+        // too. Right away if playback jumped back or the analysis settings
+        // changed; with nothing advancing the clock, whenever samples arrive.
+        bool playing = isMusicLoaded && !isPaused;
+        bool due = analyzeNow || (playing && (playT >= nextTick || playT < analyzedT)) || (!playing && gen != analyzedGen);
+
+        if ((showFFT || showFFT2 || showSpectro) && due) {
+            engine_analyze_at(engine, playT, viewPos);
+            analyzedGen = gen;
+            analyzedT = playT;
+            nextTick = (floor(playT * ANALYSIS_HZ) + 1.0) / ANALYSIS_HZ;
+            analyzeNow = false;
+            sceneDirty = true;
+
+            // One new waterfall column per analysis frame
+            if (showSpectro)
+                spectro_update(engine_snapshot(engine, 0));
+
+            if (publisher != NULL)
+                shm_publisher_push(publisher, engine_snapshot(engine, 0), engine_mode(engine), engine_rate(engine));
+        }
+
+        // Nothing is playing: let EndDrawing() block on window/input events
+        // instead of spinning at the target FPS. Any key press or file drop
+        // wakes us up and is handled on the very next iteration, which also
+        // switches back to polling before its own EndDrawing().
+        bool idle = (!isMusicLoaded || isPaused) && rec == NULL;
+        if (idle != isIdle) {
+            (idle) ? EnableEventWaiting() : DisableEventWaiting();
+            isIdle = idle;
+        }
+
+        // The trail texture has to be updated outside of BeginDrawing() and
+        // sceneCache, and only when the scene actually moves on
+        if (showFFT2 && sceneDirty)
+            trail_update(engine_snapshot(engine, 1), engine_snapshot(engine, 0), playT, w, h);
+
+        bool drawn = sceneDirty;
+
+        BeginDrawing();
 
+            // While recording every frame goes through sceneCache, which is
+            // what gets read back for the encoder
+            if (sceneDirty && rec == NULL) {
+                ClearBackground(BLACK);
+
+                drawScene(playT, w, h, showWave, showFFT, showFFT2, showSpectro, isMusicLoaded);
+
+                sceneDirty = false;
+                sceneCached = false;
+            } else {
+                if (!sceneCached || sceneDirty) {
+                    BeginTextureMode(sceneCache);
+                        ClearBackground(BLACK);
+                        drawScene(playT, w, h, showWave, showFFT, showFFT2, showSpectro, isMusicLoaded);
+                    EndTextureMode();
+                    sceneCached = true;
+                    sceneDirty = false;
+                }
 
-            if (isMusicLoaded) {
-                if (showFFT2) drawSongInfo(w/2, h/10);
-                else drawSongInfo(w/2, h/2);
+                sceneCache_present(sceneCache, w, h);
             }
 
+            if (showLatency)
+                latency_draw(&lat, h);
+
         EndDrawing();
+
+        // EndDrawing() swaps first and then waits out the rest of the frame,
+        // so by now the new frame is (about) on screen
+        if (drawn && (showFFT || showFFT2 || showSpectro) && isMusicLoaded && !isPaused) {
+            double now = wall_time();
+            latency_add(&lat, now, latency_displayed(playT, now));
+        }
+
+        if (rec != NULL)
+            recorder_capture(rec, sceneCache.texture);
     }
-    
+
+    if (rec != NULL)
+        recorder_stop(rec);
+
+    latency_report(&lat, "audio to display");
+    shm_publisher_free(publisher);
+
+    UnloadRenderTexture(sceneCache);
+    text_cache_free();
     //UnloadShader(shader);
     CloseAudioDevice();
+    if (trace != NULL) {
+        trace_stop(trace);
+        trace = NULL;
+    }
     audioBuff_free();
     tracklist_free();
         
     return 0;
 }
 
-void fft_callback(void *bufferData, unsigned int frames)
-{
-    float(*fs)[2] = bufferData; // L and R channels are the two floats
-
-    for (size_t i = 0; i < frames; i++)
-    {
-        memmove(fft->in_rawL, fft->in_rawL + 1, (N - 1) * sizeof(fft->in_rawL[0]));
-        fft->in_rawL[N - 1] = fs[i][0] + 0.0f * I; // Left channel for fft
-
-        memmove(fft->in_rawR, fft->in_rawR + 1, (N - 1) * sizeof(fft->in_rawR[0]));
-        fft->in_rawR[N - 1] = fs[i][1] + 0.0f * I; // Right channel for fft
-
-        memmove(aBuff->left, aBuff->left + 1, (SB - 1) * sizeof(aBuff->left[0]));
-        aBuff->left[SB - 1] = fs[i][0] + 0.0f * I; // Left channel
-
-        memmove(aBuff->right, aBuff->right + 1, (SB - 1) * sizeof(aBuff->right[0]));
-        aBuff->right[SB - 1] = fs[i][1] + 0.0f * I; // Right channel
-    }
-}
-
 bool isExtensionValid(const char *s)
 {
     
@@ -249,476 +859,2491 @@ void tracklist_init()
 {
     tl = (TrackList*)malloc(sizeof(TrackList));
     memset(tl, 0, sizeof(TrackList));
+
+    meta_init();
+
+    if (pcmDir != NULL)
+        pcm_init(pcmDir);
 }
 
-void tracklist_add(char* s)
+bool tracklist_add(char* s)
 {
-    tl->tracks[tl->count].file_path = strdup(s);
+    if (tl->count == (size_t)TRACK_PAGE * TRACK_PAGES) {
+        printf("ERROR: Tracklist is full (%d tracks), skipping %s\n", TRACK_PAGE * TRACK_PAGES, s);
+        return false;
+    }
+
+    Track **page = &tl->pages[tl->count / TRACK_PAGE];
+    if (*page == NULL) {
+        *page = (Track *)malloc(TRACK_PAGE * sizeof(Track));
+        memset(*page, 0, TRACK_PAGE * sizeof(Track));
+    }
+
+    tracklist_at(tl->count)->file_path = strdup(s);
+
+    // The metadata worker picks up every index below count
+    pthread_mutex_lock(&meta->lock);
     tl->count += 1;
+    pthread_cond_signal(&meta->wake);
+    pthread_mutex_unlock(&meta->lock);
+
+    if (pcmWorker != NULL) {
+        pthread_mutex_lock(&pcmWorker->lock);
+        pcmWorker->count = tl->count;
+        pthread_cond_signal(&pcmWorker->wake);
+        pthread_mutex_unlock(&pcmWorker->lock);
+    }
+
+    return true;
+}
+
+Track *tracklist_at(size_t i)
+{
+    return &tl->pages[i / TRACK_PAGE][i % TRACK_PAGE];
 }
 
 void tracklist_free()
 {
+    meta_free();
+    pcm_free();
+
+    // The audio device is closed by now, nothing reads the mapping
+    pcm_cache_close(tl->pcm);
+    tl->pcm = NULL;
+
     size_t n = tl->count;
     for (size_t i = 0; i < n; i++)
     {
-        free(tl->tracks[i].file_path);
+        free(tracklist_at(i)->file_path);
     }
+
+    for (size_t p = 0; p < TRACK_PAGES; p++)
+        free(tl->pages[p]);
 }
 
-void audioBuff_clean()
+void meta_init()
 {
-    memset(fft, 0, sizeof(*fft));
-    memset(aBuff, 0, sizeof(*aBuff));
+    meta = (Meta_Store *)malloc(sizeof(Meta_Store));
+    memset(meta, 0, sizeof(Meta_Store));
+
+    if (pcmDir != NULL)
+        snprintf(meta->file, sizeof(meta->file), "%s/%s", pcmDir, METADATA_CACHE);
+    else
+        snprintf(meta->file, sizeof(meta->file), "%s%s", GetApplicationDirectory(), METADATA_CACHE);
+
+    pthread_mutex_init(&meta->lock, NULL);
+    pthread_cond_init(&meta->wake, NULL);
+    pthread_create(&meta->thread, NULL, meta_worker, NULL);
 }
 
-void tracklist_play(int i)
+void meta_free()
 {
-    tl->currIdx = i;
-    if (tl->currIdx > (int)tl->count-1) tl->currIdx = 0;
-    if (tl->currIdx < 0) tl->currIdx = tl->count-1;
+    pthread_mutex_lock(&meta->lock);
+    meta->quit = true;
+    pthread_cond_signal(&meta->wake);
+    pthread_mutex_unlock(&meta->lock);
 
-    StopMusicStream(tl->current);
-    UnloadMusicStream(tl->current);
-    
-    tl->current = LoadMusicStream(tl->tracks[tl->currIdx].file_path);
+    pthread_join(meta->thread, NULL);
 
-    audioBuff_clean();
-    
-    AttachAudioStreamProcessor(tl->current.stream, fft_callback);
-    PlayMusicStream(tl->current);
+    if (meta->dirty)
+        meta_save(meta->file);
+
+    printf("INFO: METADATA %zu cached, %zu parsed\n", meta->hits, meta->parsed);
+
+    for (size_t i = 0; i < meta->count; i++)
+    {
+        free(meta->entries[i].path);
+        free(meta->entries[i].title);
+        free(meta->entries[i].artist);
+        free(meta->entries[i].album);
+    }
+
+    for (size_t i = 0; i < meta->retiredCount; i++)
+        free(meta->retired[i]);
+
+    free(meta->retired);
+    free(meta->entries);
+    free(meta->index);
+    pthread_mutex_destroy(&meta->lock);
+    pthread_cond_destroy(&meta->wake);
+    free(meta);
 }
 
-void audioBuff_init()
+void *meta_worker(void *arg)
 {
-    fft = (FFT_Analyzer *)malloc(sizeof(FFT_Analyzer));
-    memset(fft, 0, sizeof(FFT_Analyzer));
+    (void)arg;
 
-    aBuff = (Audio_Buffer *)malloc(sizeof(Audio_Buffer));
-    memset(aBuff, 0, sizeof(Audio_Buffer));
+    // Loaded here so a big cache never holds up the first frame
+    meta_load(meta->file);
 
-    vis = (Visualizer *)malloc(sizeof(Visualizer));
-    memset(vis, 0, sizeof(Visualizer));
-    vis->col[0] = (Color) {
-        .r = 80,
-        .g = 100,
-        .b = 120,
-        .a = 255,
-    };
-    vis->col2[0] = (Color) {
-        .r = 120,
-        .g = 100,
-        .b = 80,
-        .a = 255,
-    };
+    pthread_mutex_lock(&meta->lock);
+
+    for (;;)
+    {
+        while (meta->next >= tl->count && !meta->quit)
+            pthread_cond_wait(&meta->wake, &meta->lock);
+
+        if (meta->quit) break;
+
+        Track *track = tracklist_at(meta->next++);
+        pthread_mutex_unlock(&meta->lock);
+
+        struct stat st;
+        Meta_Entry *e = NULL;
+
+        if (stat(track->file_path, &st) == 0) {
+            e = meta_find(track->file_path);
+
+            if (e != NULL && e->mtime == (int64_t)st.st_mtime && e->size == (int64_t)st.st_size) {
+                meta->hits++;
+            } else {
+                Meta_Entry parsed = { .mtime = st.st_mtime, .size = st.st_size };
+                meta_parse(track->file_path, &parsed);
+
+                e = meta_insert(track->file_path, &parsed);
+                meta->parsed++;
+                meta->dirty = true;
+            }
+        }
+
+        if (e != NULL) {
+            track->title = e->title;
+            track->artist = e->artist;
+            track->album = e->album;
+            track->length = e->length;
+        }
+
+        // Publishes the fields above to the render thread
+        atomic_store_explicit(&track->hasMeta, true, memory_order_release);
+        worker_notify();
+
+        pthread_mutex_lock(&meta->lock);
+    }
+
+    pthread_mutex_unlock(&meta->lock);
+
+    return NULL;
 }
 
-void audioBuff_free()
+uint32_t meta_hash(const char *s)
 {
-    free(fft);
-    free(aBuff);
-    free(vis);
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *s; s++) h = (h ^ (uint8_t)*s) * 16777619u;
+    return h;
 }
 
-void _fft(float complex in[], float complex out[], int n, int step)
+Meta_Entry *meta_find(const char *path)
 {
-    if (step < n)
+    if (meta->indexCap == 0) return NULL;
+
+    size_t mask = meta->indexCap - 1;
+    for (size_t i = meta_hash(path) & mask; meta->index[i] != 0; i = (i + 1) & mask)
     {
-        _fft(out, in, n, step * 2);
-        _fft(out + step, in + step, n, step * 2);
+        Meta_Entry *e = &meta->entries[meta->index[i] - 1];
+        if (strcmp(e->path, path) == 0) return e;
+    }
+
+    return NULL;
+}
+
+Meta_Entry *meta_insert(const char *path, const Meta_Entry *src)
+{
+    // Replaces the fields of an existing (stale) entry, takes ownership of
+    // the strings in src. Tracks resolved earlier still point at the old
+    // strings and the render thread draws them, so those are only retired.
+    Meta_Entry *e = meta_find(path);
+
+    if (e != NULL) {
+        meta_retire(e->title);
+        meta_retire(e->artist);
+        meta_retire(e->album);
+        char *keep = e->path;
+        *e = *src;
+        e->path = keep;
+        return e;
+    }
 
-        for (int i = 0; i < n; i += 2 * step)
+    if (meta->count == meta->cap) {
+        meta->cap = (meta->cap == 0) ? 256 : meta->cap * 2;
+        meta->entries = (Meta_Entry *)realloc(meta->entries, meta->cap * sizeof(Meta_Entry));
+    }
+
+    // Index kept at most half full, rebuilt on growth
+    if (2 * (meta->count + 1) > meta->indexCap) {
+        free(meta->index);
+        meta->indexCap = (meta->indexCap == 0) ? 512 : meta->indexCap * 2;
+        meta->index = (uint32_t *)malloc(meta->indexCap * sizeof(uint32_t));
+        memset(meta->index, 0, meta->indexCap * sizeof(uint32_t));
+
+        for (size_t j = 0; j < meta->count; j++)
         {
-            float complex t = cexp(-I * PI * i / n) * out[i + step];
-            in[i / 2] = out[i] + t;
-            in[(i + n) / 2] = out[i] - t;
+            size_t i = meta_hash(meta->entries[j].path) & (meta->indexCap - 1);
+            while (meta->index[i] != 0) i = (i + 1) & (meta->indexCap - 1);
+            meta->index[i] = j + 1;
         }
     }
+
+    e = &meta->entries[meta->count];
+    *e = *src;
+    e->path = strdup(path);
+
+    size_t i = meta_hash(path) & (meta->indexCap - 1);
+    while (meta->index[i] != 0) i = (i + 1) & (meta->indexCap - 1);
+    meta->index[i] = ++meta->count;
+
+    return e;
 }
 
-size_t fft_process()
+void meta_retire(char *s)
 {
-    // Apply hann windowing function
-    for (size_t i = 0; i < N; i++)
-    {
-        float t = (float)i / (N - 1);
-        float hann = 0.5 - 0.5 * cosf(2 * PI * t);
-        fft->in_hannL[i] = fft->in_rawL[i] * hann;
-        fft->in_hannR[i] = fft->in_rawR[i] * hann;
-    }
+    // Freed with the store
+    if (s == NULL) return;
 
-    memcpy(fft->out_rawL, fft->in_hannL, sizeof(fft->out_rawL));
-    memcpy(fft->out_rawR, fft->in_hannR, sizeof(fft->out_rawR));
-
-    // Perform FFT
-    _fft(fft->out_rawL, fft->in_hannL, N, 1);
-    _fft(fft->out_rawR, fft->in_hannR, N, 1);
+    if (meta->retiredCount == meta->retiredCap) {
+        meta->retiredCap = (meta->retiredCap == 0) ? 64 : meta->retiredCap * 2;
+        meta->retired = (char **)realloc(meta->retired, meta->retiredCap * sizeof(char *));
+    }
 
-    // Squash Frequencies
-    // Provides for more resolution in lower frequency bins
-    // step variable will also determine the resultion of the resulting fft for display; lower step
-    // means higher resolution
-    float step = 1.01f;
-    float lowf = 1.0f;
-    size_t s = 0;
-    float max_ampL = 1.0f;
-    float max_ampR = 1.0f;
+    meta->retired[meta->retiredCount++] = s;
+}
 
-    for (float f = lowf; (size_t)f < N / 2; f = ceil(f * step))
+void meta_load(const char *file)
+{
+    // One entry per line: path, mtime, size, length, title, artist, album
+    // separated by tabs. Empty fields are tags the file does not have.
+    // Backslash, tab and line breaks inside a field are escaped.
+    FILE *f = fopen(file, "rb");
+    if (f == NULL) return;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL)
     {
-        float f1 = ceil(f * step);  // Next freq
-        int maxLi = 0;              // Max Left idx
-        int maxRi = 0;              // Max Right idx
-        float maxL = 0.0f;          // Max Left amp
-        float maxR = 0.0f;          // Max Right amp
+        char *field[7];
+        int n = 0;
+        char *p = line;
+
+        // Longer lines than the buffer were not written by meta_save
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n');
+            continue;
+        }
 
-        size_t q = (size_t)f;
-        while (q < N / 2 && q < (size_t)f1)
-        {
-            float r = cabsf(fft->out_rawR[q]);
-            float l = cabsf(fft->out_rawL[q]);
-            if (r > maxR)
-            {
-                maxR = r;
-                maxRi = q;
-            }
-            if (l > maxL)
-            {
-                maxL = l;
-                maxLi = q;
-            }
-            q++; 
+        line[strcspn(line, "\r\n")] = '\0';
+        while (n < 7) {
+            field[n++] = p;
+            p = strchr(p, '\t');
+            if (p == NULL) break;
+            *p++ = '\0';
         }
+        if (n < 7) continue;
+
+        for (int i = 0; i < 7; i++)
+            meta_unescape(field[i]);
+
+        Meta_Entry e = {
+            .mtime = strtoll(field[1], NULL, 10),
+            .size = strtoll(field[2], NULL, 10),
+            .length = strtof(field[3], NULL),
+            .title = (field[4][0] != '\0') ? strdup(field[4]) : NULL,
+            .artist = (field[5][0] != '\0') ? strdup(field[5]) : NULL,
+            .album = (field[6][0] != '\0') ? strdup(field[6]) : NULL,
+        };
+        meta_insert(field[0], &e);
+    }
 
-        // Scale logarithmically
-        fft->out_logR[s] = log10f(1.0f + cabsf(fft->out_rawL[maxRi]));
-        fft->out_logL[s] = log10f(1.0f + cabsf(fft->out_rawR[maxLi]));
-        s++;
+    fclose(f);
+    printf("INFO: METADATA Loaded %zu entries from %s\n", meta->count, file);
+}
+
+void meta_save(const char *file)
+{
+    FILE *f = fopen(file, "wb");
+    if (f == NULL) {
+        printf("ERROR: Could not write %s\n", file);
+        return;
     }
 
-    // Get max and normalize
-    for (size_t i = 0; i < s; i++)
+    for (size_t i = 0; i < meta->count; i++)
     {
-        float l = fft->out_logL[i];
-        float r = fft->out_logR[i];
-        if (l > max_ampL)
-            max_ampL = l;
-        if (r > max_ampR)
-            max_ampR = r;
+        const Meta_Entry *e = &meta->entries[i];
+        meta_write_field(f, e->path);
+        fprintf(f, "\t%lld\t%lld\t%.3f\t", (long long)e->mtime, (long long)e->size, e->length);
+        meta_write_field(f, e->title);
+        fputc('\t', f);
+        meta_write_field(f, e->artist);
+        fputc('\t', f);
+        meta_write_field(f, e->album);
+        fputc('\n', f);
     }
 
-    for (size_t i = 0; i < s; i++)
+    fclose(f);
+}
+
+void meta_write_field(FILE *f, const char *s)
+{
+    // Tabs and line breaks would split the entry on reload
+    if (s == NULL) return;
+
+    for (; *s; s++)
     {
-        fft->out_logL[i] = fft->out_logL[i] / max_ampL;
-        fft->out_logR[i] = fft->out_logR[i] / max_ampR;
+        switch (*s) {
+            case '\\': fputs("\\\\", f); break;
+            case '\t': fputs("\\t", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\r': fputs("\\r", f); break;
+            default: fputc(*s, f); break;
+        }
     }
-
-    return s;
 }
 
-void fft_visualize(size_t frames, int w, int h)
+void meta_unescape(char *s)
 {
-    float d = (float)w / frames;
+    // In place, the reverse of meta_write_field
+    char *d = s;
 
-    Vector2 ptsL_end[N / 2] = {0};
-    Vector2 ptsL_start[N / 2] = {0};
-    Vector2 ptsR_end[N / 2] = {0};
-    Vector2 ptsR_start[N / 2] = {0};
+    for (; *s; s++)
+    {
+        if (*s != '\\' || s[1] == '\0') {
+            *d++ = *s;
+            continue;
+        }
 
-    Color cL = (Color){100, 0, 255, 255};
-    Color cR = (Color){255, 0, 100, 255};
+        s++;
+        switch (*s) {
+            case 't': *d++ = '\t'; break;
+            case 'n': *d++ = '\n'; break;
+            case 'r': *d++ = '\r'; break;
+            default: *d++ = *s; break;
+        }
+    }
 
+    *d = '\0';
+}
 
-    for (size_t i = 0; i < frames; i++)
-    {
-        ptsL_end[i] = (Vector2) {
-            .x = i * d,
-            .y = ((float)h / 2) + fft->out_logL[i] * h/2
-        };
+char *meta_text(const uint8_t *p, size_t n, int enc)
+{
+    // Tag text to UTF-8. enc follows ID3v2: 0 latin-1, 1 UTF-16 with BOM,
+    // 2 UTF-16BE, 3 UTF-8. Tabs and line breaks become spaces so the
+    // string fits on one cache line.
+    char *out = (char *)malloc(n * 3 + 1);
+    size_t o = 0;
+
+    if (enc == 1 || enc == 2) {
+        bool le = false;
+        size_t i = 0;
+
+        if (enc == 1 && n >= 2) {
+            le = (p[0] == 0xFF && p[1] == 0xFE);
+            if ((p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF)) i = 2;
+        }
 
-        ptsL_start[i] = (Vector2) {
-            .x = i * d,
-            .y = (float)h / 2
-        };
+        for (; i + 1 < n; i += 2)
+        {
+            uint32_t c = le ? (p[i] | p[i + 1] << 8) : (p[i] << 8 | p[i + 1]);
+            if (c == 0) break;
 
-        ptsR_end[i] = (Vector2) {
-            .x = i * d,
-            .y = ((float)h / 2) - fft->out_logR[i] * h/2
-        };
+            if (c >= 0xD800 && c < 0xDC00 && i + 3 < n) {
+                uint32_t lo = le ? (p[i + 2] | p[i + 3] << 8) : (p[i + 2] << 8 | p[i + 3]);
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
 
-        ptsR_start[i] = (Vector2) {
-            .x = i * d,
-            .y = (float)h / 2
-        };
+            if (c < 0x80) {
+                out[o++] = c;
+            } else if (c < 0x800) {
+                out[o++] = 0xC0 | (c >> 6);
+                out[o++] = 0x80 | (c & 0x3F);
+            } else if (c < 0x10000) {
+                out[o++] = 0xE0 | (c >> 12);
+                out[o++] = 0x80 | ((c >> 6) & 0x3F);
+                out[o++] = 0x80 | (c & 0x3F);
+            } else {
+                // Four byte sequence, the n * 3 bound holds since it took four input bytes
+                out[o++] = 0xF0 | (c >> 18);
+                out[o++] = 0x80 | ((c >> 12) & 0x3F);
+                out[o++] = 0x80 | ((c >> 6) & 0x3F);
+                out[o++] = 0x80 | (c & 0x3F);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < n && p[i] != 0; i++)
+        {
+            if (enc == 0 && p[i] >= 0x80) {
+                out[o++] = 0xC0 | (p[i] >> 6);
+                out[o++] = 0x80 | (p[i] & 0x3F);
+            } else {
+                out[o++] = p[i];
+            }
+        }
+    }
 
-        // Draw Bars with alpha values based on amplituded / display height
-        Color cL2 = (Color){
-            100,
-            0,
-            255,
-            ((ptsL_end[i].y - ptsL_start[i].y) / (h/2))*255
-        };
-        
-        Color cR2 = (Color){
-            255,
-            0,
-            100,
-            ((ptsR_start[i].y - ptsR_end[i].y) / (h/2))*255
-        };
+    out[o] = '\0';
+    for (size_t i = 0; i < o; i++)
+        if (out[i] == '\t' || out[i] == '\n' || out[i] == '\r') out[i] = ' ';
 
-        DrawLineEx(ptsR_start[i], ptsR_end[i], d, cR2);
-        DrawLineEx(ptsL_start[i], ptsL_end[i], d, cL2);
+    // Trailing padding some taggers leave behind
+    while (o > 0 && out[o - 1] == ' ') out[--o] = '\0';
 
+    if (o == 0) {
+        free(out);
+        return NULL;
     }
 
-    DrawLineStrip(ptsL_end, frames, cL);
-    DrawLineStrip(ptsR_end, frames, cR);
+    return out;
 }
 
-void fft_visualize2(size_t frames, int w, int h)
+void meta_parse(const char *path, Meta_Entry *e)
 {
-    frames -= 250;
-    float radius = 2.3f*h/5.0f;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return;
 
-    // This number represents the highest element of the buffer for the internal visualization
-    size_t lowCap = 100;
+    const char *ext = GetFileExtension(path);
 
-    // Get change in color for outer visualization 
-    Color prev = vis->col[0];
+    if (strcmp(ext, ".mp3") == 0) meta_parse_mp3(f, e);
+    else if (strcmp(ext, ".ogg") == 0) meta_parse_ogg(f, e);
+    else if (strcmp(ext, ".wav") == 0) meta_parse_wav(f, e);
 
-    int red = prev.r;
-    int green = prev.g;
-    int blue = prev.b;
+    fclose(f);
+}
 
-    switch (GetRandomValue(0,2)) {
-        case 0:
-            red = GetRandomValue(prev.r - 1, prev.r + 1);
+void meta_parse_mp3(FILE *f, Meta_Entry *e)
+{
+    uint8_t hdr[10];
+    long audioStart = 0;
+
+    // ID3v2 tag: TIT2/TPE1/TALB frames (TT2/TP1/TAL in v2.2)
+    if (fread(hdr, 1, 10, f) == 10 && memcmp(hdr, "ID3", 3) == 0) {
+        int ver = hdr[3];
+        size_t size = (hdr[6] & 0x7F) << 21 | (hdr[7] & 0x7F) << 14 | (hdr[8] & 0x7F) << 7 | (hdr[9] & 0x7F);
+        audioStart = 10 + size + ((hdr[5] & 0x10) ? 10 : 0);
+
+        // Text frames sit in front of any cover art, no need to read that
+        size_t want = (size < (1 << 18)) ? size : (1 << 18);
+        uint8_t *buf = (uint8_t *)malloc(want);
+        size_t len = fread(buf, 1, want, f);
+        size_t pos = 0;
+
+        if (hdr[5] & 0x40 && len >= 4) {
+            size_t ext = (ver == 4)
+                ? (size_t)((buf[0] & 0x7F) << 21 | (buf[1] & 0x7F) << 14 | (buf[2] & 0x7F) << 7 | (buf[3] & 0x7F))
+                : (size_t)(buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]) + 4;
+            pos = ext;
+        }
+
+        int hlen = (ver == 2) ? 6 : 10;
+        int idlen = (ver == 2) ? 3 : 4;
+
+        while (pos + hlen <= len && buf[pos] != 0)
+        {
+            const uint8_t *fh = buf + pos;
+            size_t fsize;
+
+            if (ver == 2) fsize = fh[3] << 16 | fh[4] << 8 | fh[5];
+            else if (ver == 4) fsize = (fh[4] & 0x7F) << 21 | (fh[5] & 0x7F) << 14 | (fh[6] & 0x7F) << 7 | (fh[7] & 0x7F);
+            else fsize = (size_t)fh[4] << 24 | fh[5] << 16 | fh[6] << 8 | fh[7];
+
+            if (fsize == 0 || pos + hlen + fsize > len) break;
+
+            const uint8_t *body = fh + hlen;
+            char **dst = NULL;
+
+            if (memcmp(fh, (ver == 2) ? "TT2" : "TIT2", idlen) == 0) dst = &e->title;
+            else if (memcmp(fh, (ver == 2) ? "TP1" : "TPE1", idlen) == 0) dst = &e->artist;
+            else if (memcmp(fh, (ver == 2) ? "TAL" : "TALB", idlen) == 0) dst = &e->album;
+
+            if (dst != NULL && *dst == NULL)
+                *dst = meta_text(body + 1, fsize - 1, body[0]);
+
+            pos += hlen + fsize;
+        }
+
+        free(buf);
+    }
+
+    // Duration from the first MPEG audio frame: the Xing/Info or VBRI frame
+    // count when there is one, the constant bitrate otherwise
+    fseek(f, 0, SEEK_END);
+    long fileSize = ftell(f);
+
+    uint8_t buf[1 << 16];
+    fseek(f, audioStart, SEEK_SET);
+    size_t len = fread(buf, 1, sizeof(buf), f);
+
+    static const int kbpsV1[16] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+    static const int kbpsV2[16] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+    static const int rates[3] = { 44100, 48000, 32000 };
+
+    for (size_t i = 0; i + 4 <= len; i++)
+    {
+        if (buf[i] != 0xFF || (buf[i + 1] & 0xE0) != 0xE0) continue;
+
+        int version = (buf[i + 1] >> 3) & 3;     // 3 MPEG-1, 2 MPEG-2, 0 MPEG-2.5
+        int layer = (buf[i + 1] >> 1) & 3;       // 1 Layer III
+        int brIdx = buf[i + 2] >> 4;
+        int srIdx = (buf[i + 2] >> 2) & 3;
+        bool mono = (buf[i + 3] >> 6) == 3;
+
+        if (version == 1 || layer != 1 || brIdx == 0 || brIdx == 15 || srIdx == 3) continue;
+
+        bool v1 = (version == 3);
+        int rate = rates[srIdx] >> (v1 ? 0 : (version == 2) ? 1 : 2);
+        int kbps = v1 ? kbpsV1[brIdx] : kbpsV2[brIdx];
+        int spf = v1 ? 1152 : 576;
+
+        size_t xing = i + 4 + (v1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+        uint32_t frames = 0;
+
+        if (xing + 12 <= len && (memcmp(buf + xing, "Xing", 4) == 0 || memcmp(buf + xing, "Info", 4) == 0)) {
+            const uint8_t *x = buf + xing;
+            if (x[7] & 1) frames = (uint32_t)x[8] << 24 | x[9] << 16 | x[10] << 8 | x[11];
+        } else if (i + 36 + 18 <= len && memcmp(buf + i + 36, "VBRI", 4) == 0) {
+            const uint8_t *x = buf + i + 36;
+            frames = (uint32_t)x[14] << 24 | x[15] << 16 | x[16] << 8 | x[17];
+        }
+
+        if (frames > 0) e->length = (float)frames * spf / rate;
+        else e->length = (float)(fileSize - audioStart - (long)i) * 8.0f / (kbps * 1000.0f);
+
+        break;
+    }
+}
+
+void meta_parse_ogg(FILE *f, Meta_Entry *e)
+{
+    // Vorbis comment header out of the first pages. Packets can span pages,
+    // so the page payloads are joined before looking for it.
+    uint8_t raw[1 << 16];
+    size_t len = fread(raw, 1, sizeof(raw), f);
+
+    uint8_t *data = (uint8_t *)malloc(len);
+    size_t dlen = 0;
+
+    for (size_t pos = 0; pos + 27 <= len && memcmp(raw + pos, "OggS", 4) == 0;)
+    {
+        int segs = raw[pos + 26];
+        if (pos + 27 + segs > len) break;
+
+        size_t body = 0;
+        for (int s = 0; s < segs; s++) body += raw[pos + 27 + s];
+
+        size_t start = pos + 27 + segs;
+        size_t take = (start + body <= len) ? body : len - start;
+        memcpy(data + dlen, raw + start, take);
+        dlen += take;
+        pos = start + body;
+    }
+
+    uint32_t rate = 0;
+
+    for (size_t i = 0; i + 16 <= dlen; i++)
+    {
+        if (data[i] == 1 && memcmp(data + i + 1, "vorbis", 6) == 0 && rate == 0) {
+            rate = data[i + 12] | data[i + 13] << 8 | data[i + 14] << 16 | (uint32_t)data[i + 15] << 24;
+            continue;
+        }
+
+        if (data[i] != 3 || memcmp(data + i + 1, "vorbis", 6) != 0) continue;
+
+        size_t p = i + 7;
+        if (p + 4 > dlen) break;
+        uint32_t vendor = data[p] | data[p + 1] << 8 | data[p + 2] << 16 | (uint32_t)data[p + 3] << 24;
+        p += 4 + vendor;
+        if (p + 4 > dlen) break;
+        uint32_t count = data[p] | data[p + 1] << 8 | data[p + 2] << 16 | (uint32_t)data[p + 3] << 24;
+        p += 4;
+
+        for (uint32_t c = 0; c < count && p + 4 <= dlen; c++)
+        {
+            uint32_t n = data[p] | data[p + 1] << 8 | data[p + 2] << 16 | (uint32_t)data[p + 3] << 24;
+            p += 4;
+            if (p + n > dlen) break;
+
+            const char *kv = (const char *)data + p;
+            char **dst = NULL;
+            size_t key = 0;
+
+            if (n > 6 && strncasecmp(kv, "TITLE=", 6) == 0) { dst = &e->title; key = 6; }
+            else if (n > 7 && strncasecmp(kv, "ARTIST=", 7) == 0) { dst = &e->artist; key = 7; }
+            else if (n > 6 && strncasecmp(kv, "ALBUM=", 6) == 0) { dst = &e->album; key = 6; }
+
+            if (dst != NULL && *dst == NULL)
+                *dst = meta_text(data + p + key, n - key, 3);
+
+            p += n;
+        }
+
+        break;
+    }
+
+    free(data);
+
+    // Duration from the granule position (samples) of the last page
+    if (rate == 0) return;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    long from = (size > (long)sizeof(raw)) ? size - (long)sizeof(raw) : 0;
+    fseek(f, from, SEEK_SET);
+    len = fread(raw, 1, sizeof(raw), f);
+
+    for (size_t i = (len >= 27) ? len - 26 : 0; i-- > 0;)
+    {
+        if (memcmp(raw + i, "OggS", 4) != 0 || raw[i + 4] != 0) continue;
+
+        int64_t granule = 0;
+        for (int b = 7; b >= 0; b--) granule = granule << 8 | raw[i + 6 + b];
+
+        if (granule > 0) e->length = (float)((double)granule / rate);
+        break;
+    }
+}
+
+void meta_parse_wav(FILE *f, Meta_Entry *e)
+{
+    // RIFF chunks: duration from fmt + data, tags from the LIST/INFO chunk
+    // (INAM, IART, IPRD)
+    uint8_t hdr[12];
+    if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0) return;
+
+    uint32_t byteRate = 0;
+    uint32_t dataSize = 0;
+    uint8_t ch[8];
+
+    while (fread(ch, 1, 8, f) == 8)
+    {
+        uint32_t size = ch[4] | ch[5] << 8 | ch[6] << 16 | (uint32_t)ch[7] << 24;
+        long next = ftell(f) + size + (size & 1);
+
+        if (memcmp(ch, "fmt ", 4) == 0 && size >= 16) {
+            uint8_t fmt[16];
+            if (fread(fmt, 1, 16, f) == 16)
+                byteRate = fmt[8] | fmt[9] << 8 | fmt[10] << 16 | (uint32_t)fmt[11] << 24;
+        } else if (memcmp(ch, "data", 4) == 0) {
+            dataSize = size;
+        } else if (memcmp(ch, "LIST", 4) == 0 && size >= 4 && size <= (1 << 16)) {
+            uint8_t *list = (uint8_t *)malloc(size);
+
+            if (fread(list, 1, size, f) == size && memcmp(list, "INFO", 4) == 0) {
+                for (size_t p = 4; p + 8 <= size;)
+                {
+                    uint32_t n = list[p + 4] | list[p + 5] << 8 | list[p + 6] << 16 | (uint32_t)list[p + 7] << 24;
+                    if (p + 8 + n > size) break;
+
+                    char **dst = NULL;
+                    if (memcmp(list + p, "INAM", 4) == 0) dst = &e->title;
+                    else if (memcmp(list + p, "IART", 4) == 0) dst = &e->artist;
+                    else if (memcmp(list + p, "IPRD", 4) == 0) dst = &e->album;
+
+                    if (dst != NULL && *dst == NULL)
+                        *dst = meta_text(list + p + 8, n, 0);
+
+                    p += 8 + n + (n & 1);
+                }
+            }
+
+            free(list);
+        }
+
+        if (fseek(f, next, SEEK_SET) != 0) break;
+    }
+
+    if (byteRate > 0) e->length = (float)dataSize / byteRate;
+}
+
+void tracklist_play(int i)
+{
+    tl->currIdx = i;
+    if (tl->currIdx > (int)tl->count-1) tl->currIdx = 0;
+    if (tl->currIdx < 0) tl->currIdx = tl->count-1;
+
+    if (tl->pcm != NULL) {
+        // Once unloaded, the stream callback can't be running on the mapping
+        UnloadAudioStream(tl->pcmStream);
+        pcm_cache_close(tl->pcm);
+        tl->pcm = NULL;
+    } else {
+        StopMusicStream(tl->current);
+        UnloadMusicStream(tl->current);
+        tl->current = (Music){0};
+    }
+
+    // Nothing precedes the start of a track, so silence is the right
+    // history for the first window
+    engine_reset(engine);
+
+    // A cached track plays straight from its mapping, no decoder involved
+    Track *track = tracklist_at(tl->currIdx);
+    if (pcmWorker != NULL && atomic_load_explicit(&track->hasPcm, memory_order_acquire))
+        tl->pcm = pcm_cache_open(pcmWorker->dir, track->pcmKey);
+
+    if (tl->pcm != NULL) {
+        atomic_store(&tl->pcmPos, 0);
+        tl->pcmStream = LoadAudioStream(tl->pcm->sampleRate, 16, tl->pcm->channels);
+        SetAudioStreamCallback(tl->pcmStream, pcm_callback);
+        AttachAudioStreamProcessor(tl->pcmStream, fft_callback);
+        PlayAudioStream(tl->pcmStream);
+        return;
+    }
+
+    tl->current = LoadMusicStream(track->file_path);
+
+    AttachAudioStreamProcessor(tl->current.stream, fft_callback);
+    PlayMusicStream(tl->current);
+}
+
+void tracklist_seek(float position)
+{
+    // SeekMusicStream (or a jump of the cache reader), plus the window of audio right before the new
+    // position decoded into the engine, so the first spectrum after the seek
+    // is already of the new position instead of old audio or silence
+    Music music = tl->current;
+    const Pcm_Map *pcm = tl->pcm;
+    AudioStream stream = (pcm != NULL) ? tl->pcmStream : music.stream;
+    size_t total = (pcm != NULL) ? pcm->frames : music.frameCount;
+    unsigned int srcRate = stream.sampleRate;
+    unsigned int ch = stream.channels;
+    unsigned int dstRate = engine_rate(engine);
+
+    if (total == 0) return;
+    if (position < 0.0f) position = 0.0f;
+    if (position * srcRate >= total) position = (float)(total - 1) / srcRate;
+
+    // Source frames covering N device frames, ending at the target
+    size_t at = (size_t)(position * srcRate);
+    size_t want = (size_t)ceil((double)N * srcRate / dstRate) + 1;
+    size_t from = (at > want) ? at - want : 0;
+    size_t count = at - from;
+
+    float *src = (float *)malloc((want + 1) * ch * sizeof(float));
+    size_t got = 0;
+    double t0 = wall_time();
+
+    // The decoder is only touched from this thread (UpdateMusicStream), and
+    // SeekMusicStream below moves it to the target again. Cached tracks
+    // need no decoder at all.
+    switch ((pcm != NULL) ? -1 : music.ctxType)
+    {
+        case -1:
+            for (size_t i = 0; i < count * ch; i++)
+                src[i] = pcm->samples[from * ch + i] / 32768.0f;
+            got = count;
             break;
-        case 1:
-            green = GetRandomValue(prev.g - 1, prev.g + 1);
+        case MUSIC_CTX_WAV:
+            if (drwav_seek_to_pcm_frame(music.ctxData, from))
+                got = (size_t)drwav_read_pcm_frames_f32(music.ctxData, count, src);
             break;
-        case 2:
-            blue = GetRandomValue(prev.b - 1, prev.b + 1);
+        case MUSIC_CTX_MP3:
+            if (drmp3_seek_to_pcm_frame(music.ctxData, from))
+                got = (size_t)drmp3_read_pcm_frames_f32(music.ctxData, count, src);
+            break;
+        case MUSIC_CTX_OGG:
+            if (stb_vorbis_seek(music.ctxData, (unsigned int)from))
+                got = (size_t)stb_vorbis_get_samples_float_interleaved(music.ctxData, ch, src, (int)(count * ch));
             break;
         default:
             break;
     }
 
-    int total = red + green + blue;
-
-    red = 255 * ((float)red/total);
-    green = 255 * ((float)green/total);
-    blue = 255 * ((float)blue/total);
+    if (got == 0 && count > 0) {
+        // Unknown decoder: the tap just refills as playback goes on
+        free(src);
+        SeekMusicStream(music, position);
+        return;
+    }
+
+    // To the device format the tap normally sees (stereo at the device
+    // rate), newest frame aligned to the target. Linear interpolation is
+    // plenty for a window that gets replaced within a fraction of a second.
+    size_t frames = (got > 1) ? (size_t)((double)(got - 1) * dstRate / srcRate) + 1 : got;
+    if (frames > N) frames = N;
+    float *dst = (float *)malloc((frames + 1) * 2 * sizeof(float));
+
+    for (size_t j = 0; j < frames; j++)
+    {
+        double x = (double)(got - 1) - (double)(frames - 1 - j) * srcRate / dstRate;
+        size_t i0 = (x > 0.0) ? (size_t)x : 0;
+        size_t i1 = (i0 + 1 < got) ? i0 + 1 : i0;
+        float f = (float)(x - i0);
+
+        for (unsigned int c = 0; c < 2; c++)
+        {
+            unsigned int k = (c < ch) ? c : 0;
+            dst[2 * j + c] = src[i0 * ch + k] + f * (src[i1 * ch + k] - src[i0 * ch + k]);
+        }
+    }
+
+    // No callback may push while the engine starts over
+    DetachAudioStreamProcessor(stream, fft_callback);
+    engine_prime(engine, dst, (unsigned int)frames);
+    if (pcm != NULL) atomic_store(&tl->pcmPos, at);
+    else SeekMusicStream(music, position);
+    AttachAudioStreamProcessor(stream, fft_callback);
+
+    printf("INFO: Seek to %.2f s, %zu frames of history decoded in %.2f ms\n", position, got, (wall_time() - t0) * 1000.0);
+
+    free(src);
+    free(dst);
+}
+
+float tracklist_time()
+{
+    // Position decoding (or the cache reader) has reached, in seconds
+    if (tl->pcm != NULL) return (float)atomic_load(&tl->pcmPos) / tl->pcm->sampleRate;
+    return GetMusicTimePlayed(tl->current);
+}
+
+float tracklist_length()
+{
+    if (tl->pcm != NULL) return (float)tl->pcm->frames / tl->pcm->sampleRate;
+    return GetMusicTimeLength(tl->current);
+}
+
+bool tracklist_playing()
+{
+    if (tl->pcm != NULL) return IsAudioStreamPlaying(tl->pcmStream);
+    return IsMusicStreamPlaying(tl->current);
+}
+
+void tracklist_pause(bool pause)
+{
+    if (tl->pcm != NULL) (pause) ? PauseAudioStream(tl->pcmStream) : ResumeAudioStream(tl->pcmStream);
+    else (pause) ? PauseMusicStream(tl->current) : ResumeMusicStream(tl->current);
+}
+
+void tracklist_update()
+{
+    // Cached tracks are pulled by the audio thread through pcm_callback
+    if (tl->pcm == NULL && IsMusicStreamPlaying(tl->current))
+        UpdateMusicStream(tl->current);
+}
+
+void tracklist_hold(bool hold)
+{
+    // Keeps the audio thread out of the engine (true) until released
+    // (false), for engine calls that must not overlap engine_push. Without
+    // a loaded stream nothing pushes anyway.
+    AudioStream stream = (tl->pcm != NULL) ? tl->pcmStream : tl->current.stream;
+    if (stream.buffer == NULL) return;
+
+    if (hold) DetachAudioStreamProcessor(stream, fft_callback);
+    else AttachAudioStreamProcessor(stream, fft_callback);
+}
+
+void pcm_callback(void *bufferData, unsigned int frames)
+{
+    // Audio thread: frames of the cached track copied straight from the
+    // mapping, looping at the end like Music does. A seek that lands while
+    // this runs wins over the position advanced here.
+    const Pcm_Map *m = tl->pcm;
+    int16_t *out = bufferData;
+    size_t ch = m->channels;
+    size_t start = atomic_load(&tl->pcmPos);
+    size_t pos = start;
+
+    if (m->frames == 0) {
+        memset(out, 0, (size_t)frames * ch * sizeof(int16_t));
+        return;
+    }
+
+    for (size_t done = 0; done < frames;)
+    {
+        if (pos >= m->frames) pos = 0;
+
+        size_t n = (frames - done < m->frames - pos) ? frames - done : m->frames - pos;
+        memcpy(out + done * ch, m->samples + pos * ch, n * ch * sizeof(int16_t));
+        done += n;
+        pos += n;
+    }
+
+    atomic_compare_exchange_strong(&tl->pcmPos, &start, pos);
+}
+
+void pcm_init(const char *dir)
+{
+    pcm_cache_mkdir(dir);
+
+    pcmWorker = (Pcm_Worker *)malloc(sizeof(Pcm_Worker));
+    memset(pcmWorker, 0, sizeof(Pcm_Worker));
+    pcmWorker->dir = dir;
+
+    pthread_mutex_init(&pcmWorker->lock, NULL);
+    pthread_cond_init(&pcmWorker->wake, NULL);
+    pthread_create(&pcmWorker->thread, NULL, pcm_worker, NULL);
+
+    printf("INFO: PCM Caching decoded tracks in %s\n", dir);
+}
+
+void pcm_free()
+{
+    if (pcmWorker == NULL) return;
+
+    // A track being decoded is finished first
+    pthread_mutex_lock(&pcmWorker->lock);
+    pcmWorker->quit = true;
+    pthread_cond_signal(&pcmWorker->wake);
+    pthread_mutex_unlock(&pcmWorker->lock);
+
+    pthread_join(pcmWorker->thread, NULL);
+
+    printf("INFO: PCM %zu cached, %zu decoded\n", pcmWorker->hits, pcmWorker->decoded);
+
+    pthread_mutex_destroy(&pcmWorker->lock);
+    pthread_cond_destroy(&pcmWorker->wake);
+    free(pcmWorker);
+    pcmWorker = NULL;
+}
+
+void *pcm_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&pcmWorker->lock);
+
+    for (;;)
+    {
+        while (pcmWorker->next >= pcmWorker->count && !pcmWorker->quit)
+            pthread_cond_wait(&pcmWorker->wake, &pcmWorker->lock);
+
+        if (pcmWorker->quit) break;
+
+        Track *track = tracklist_at(pcmWorker->next++);
+        pthread_mutex_unlock(&pcmWorker->lock);
+
+        uint64_t key = pcm_cache_key(track->file_path);
+        bool ready = false;
+
+        if (key != 0) {
+            Pcm_Map *m = pcm_cache_open(pcmWorker->dir, key);
+
+            if (m != NULL) {
+                pcm_cache_close(m);
+                pcmWorker->hits++;
+                ready = true;
+            } else {
+                // Decoded at the file's own rate and channel count, the
+                // audio device converts on playback like it does for Music
+                double t0 = wall_time();
+                Wave wave = LoadWave(track->file_path);
+
+                if (wave.frameCount > 0) {
+                    WaveFormat(&wave, wave.sampleRate, 16, wave.channels);
+                    ready = pcm_cache_store(pcmWorker->dir, key, wave.data, wave.frameCount, wave.sampleRate, wave.channels);
+                    pcmWorker->decoded++;
+
+                    printf("INFO: PCM Decoded %s (%.1f s of audio) in %.2f s\n", track->file_path,
+                        (double)wave.frameCount / wave.sampleRate, wall_time() - t0);
+                }
+
+                UnloadWave(wave);
+            }
+        }
+
+        // Publishes pcmKey to the render thread
+        track->pcmKey = key;
+        atomic_store_explicit(&track->hasPcm, ready, memory_order_release);
+        worker_notify();
+
+        pthread_mutex_lock(&pcmWorker->lock);
+    }
+
+    pthread_mutex_unlock(&pcmWorker->lock);
+
+    return NULL;
+}
+
+void worker_notify()
+{
+    // A paused or empty player sits in EndDrawing() waiting for events, so
+    // it needs one to pick up the new title
+    atomic_fetch_add(&workerResults, 1);
+    glfwPostEmptyEvent();
+}
+
+void fft_callback(void *bufferData, unsigned int frames)
+{
+    // raylib processors get no user pointer, so this feeds the one engine
+    engine_push(engine, bufferData, frames);
+    rate_probe_tap(&rateProbe, frames);
+
+    if (trace != NULL)
+        trace_tap(trace, bufferData, frames);
+}
+
+void rate_probe_tap(Rate_Probe *rp, unsigned int frames)
+{
+    // Audio thread. Each buffer took frames / rate to play since the one
+    // before it, as long as playback ran on in between (pauses, device
+    // hiccups and the first buffer start the measurement over).
+    if (atomic_load_explicit(&rp->rate, memory_order_relaxed) != 0) return;
+
+    double now = wall_time();
+    double gap = now - rp->last;
+    rp->last = now;
+
+    if (gap > 0.1) {
+        rp->elapsed = 0.0;
+        rp->frames = 0;
+        return;
+    }
+
+    rp->elapsed += gap;
+    rp->frames += frames;
+    if (rp->elapsed < RATE_PROBE_SECONDS) return;
+
+    // Snapped to the nearest common rate, the wall clock is only that good
+    static const unsigned int common[] = { 8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
+    double measured = rp->frames / rp->elapsed;
+    unsigned int rate = (unsigned int)lround(measured);
+
+    for (size_t i = 0; i < sizeof(common) / sizeof(common[0]); i++)
+        if (fabs(measured - common[i]) < 0.03 * common[i]) rate = common[i];
+
+    atomic_store(&rp->rate, rate);
+}
+
+bool audio_sync()
+{
+    // Hands the engine the device rate once it is measured, until then the
+    // rate it was created with stands in. Returns true when it changed.
+    // The output latency is left to the engine's own estimate: processors
+    // run in the device callback after the stream's sub-buffer has already
+    // been read and converted, so what the tap sees plays about one device
+    // period later, which is the block size the tap is handed.
+    unsigned int rate = atomic_load(&rateProbe.rate);
+
+    if (rate == 0 || rate == engine_rate(engine)) return false;
+
+    printf("INFO: AUDIO Device runs at %u Hz (measured), not %u Hz\n", rate, engine_rate(engine));
+    engine_set_rate(engine, rate);
+
+    printf("INFO: AUDIO Output latency %.1f ms (one device period)\n", 1000.0 * engine_output_latency(engine));
+
+    return true;
+}
+
+void audioBuff_init(unsigned int sampleRate, unsigned int channels)
+{
+    // Inner ring of fft_visualize2: display bins 0..99 are FFT bins 1..100
+    int lowBins[100];
+    for (int i = 0; i < 100; i++) lowBins[i] = i + 1;
+
+    Engine_Config cfg = {
+        .sampleRate = sampleRate,
+        .channels = channels,
+#ifdef FFT_Q15_DEFAULT
+        .useQ15 = true,
+#endif
+        .lowBins = lowBins,
+        .lowBinCount = 100,
+    };
+    engine = engine_create(&cfg);
+
+    vis = (Visualizer *)malloc(sizeof(Visualizer));
+    memset(vis, 0, sizeof(Visualizer));
+    vis->col = (Color) {
+        .r = 80,
+        .g = 100,
+        .b = 120,
+        .a = 255,
+    };
+    vis->col2 = (Color) {
+        .r = 120,
+        .g = 100,
+        .b = 80,
+        .a = 255,
+    };
+}
+
+void audioBuff_free()
+{
+    engine_free(engine);
+    engine = NULL;
+    if (vis->trail.id != 0) UnloadRenderTexture(vis->trail);
+    if (vis->trailSoft != NULL) soft_free(vis->trailSoft);
+    if (vis->spectro.id != 0) UnloadTexture(vis->spectro);
+    free(vis->spectroSoft);
+    free(vis);
+}
+
+// Bar positions, width and colors only depend on the render size and the
+// band count, so they are laid out together with the bands and kept
+void fft_bars_layout(size_t frames, int w, int h)
+{
+    if (vis->barW == w && vis->barH == h && vis->barCount == frames) return;
+
+    vis->barD = (float)w / frames;
+    for (size_t i = 0; i < frames; i++)
+    {
+        vis->barBase[i] = (Vector2) {
+            .x = i * vis->barD,
+            .y = (float)h / 2
+        };
+    }
+
+    vis->barL = (Color){100, 0, 255, 255};
+    vis->barR = (Color){255, 0, 100, 255};
+    vis->barCount = frames;
+    vis->barW = w;
+    vis->barH = h;
+}
+
+void fft_visualize(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, int w, int h)
+{
+    float logL[N / 2];
+    float logR[N / 2];
+    size_t frames = spectrum_lerp(a, b, t, logL, logR);
+
+    fft_bars_layout(frames, w, h);
+    float d = vis->barD;
+
+    Vector2 ptsL_end[N / 2];
+    Vector2 ptsR_end[N / 2];
+
+    for (size_t i = 0; i < frames; i++)
+    {
+        Vector2 base = vis->barBase[i];
+
+        ptsL_end[i] = (Vector2) {
+            .x = base.x,
+            .y = base.y + logL[i] * h/2
+        };
+
+        ptsR_end[i] = (Vector2) {
+            .x = base.x,
+            .y = base.y - logR[i] * h/2
+        };
+
+        // Draw Bars with alpha values based on amplituded / display height
+        Color cL2 = vis->barL;
+        cL2.a = ((ptsL_end[i].y - base.y) / (h/2))*255;
+
+        Color cR2 = vis->barR;
+        cR2.a = ((base.y - ptsR_end[i].y) / (h/2))*255;
+
+        gfx_line(base, ptsR_end[i], d, cR2);
+        gfx_line(base, ptsL_end[i], d, cL2);
+
+    }
+
+    gfx_line_strip(ptsL_end, frames, vis->barL);
+    gfx_line_strip(ptsR_end, frames, vis->barR);
+}
+
+void trail_update(const Spectrum_Snapshot *a, const Spectrum_Snapshot *b, double t, int w, int h)
+{
+    float logL[N / 2];
+    float logR[N / 2];
+    size_t frames = spectrum_lerp(a, b, t, logL, logR);
+
+    vis->outCount = 0;
+    vis->out2Count = 0;
+
+    // This number represents the highest element of the buffer for the internal visualization
+    size_t lowCap = 100;
+
+    // Constant-Q bins have a layout of their own
+    size_t top = (engine_mode(engine) == ANALYSIS_CQT) ? ((frames > 250) ? frames - 250 : 0) : engine_band_of(engine, RING_TOP_BIN);
+    if (top <= lowCap + 1) return;
+    frames = top;
+    float radius = 2.3f*h/5.0f;
+
+    // The inner ring reads the sliding DFT, which is current to the last
+    // sample the tap saw, instead of waiting for the next full analysis.
+    // While the visuals follow the playing sample (viewPos trails the tap
+    // by the output latency) that would put it ahead of the outer ring and
+    // the audio, so it takes the low bins of the aligned analysis then.
+    float lowL[SDFT_MAX_BINS];
+    float lowR[SDFT_MAX_BINS];
+    bool lagging = viewPos + N / 2 < engine_position(engine);
+    const float *inner = (!lagging && engine_low_bins(engine, lowL, lowR) >= lowCap) ? lowL : logL;
+
+    // Get change in color for outer visualization 
+    Color prev = vis->col;
+
+    int red = prev.r;
+    int green = prev.g;
+    int blue = prev.b;
+
+    switch (GetRandomValue(0,2)) {
+        case 0:
+            red = GetRandomValue(prev.r - 1, prev.r + 1);
+            break;
+        case 1:
+            green = GetRandomValue(prev.g - 1, prev.g + 1);
+            break;
+        case 2:
+            blue = GetRandomValue(prev.b - 1, prev.b + 1);
+            break;
+        default:
+            break;
+    }
+
+    int total = red + green + blue;
+
+    red = 255 * ((float)red/total);
+    green = 255 * ((float)green/total);
+    blue = 255 * ((float)blue/total);
+
+    Color newColor =  (Color) {
+        .r = red, 
+        .g = green,
+        .b = blue,
+        .a = 255,
+    };
+
+    vis->col = newColor; 
+    
+    // Save fft data to the outline buffer
+    vis->outCount = frames-lowCap;
+    engine_ring(logL + lowCap, vis->outCount, 0.20f, 0.17f, w/2, h/2, radius, (float *)vis->out);
+
+    // Repeat steps for internal visualization
+
+    prev = vis->col2;
+
+    red = prev.r;
+    green = prev.g;
+    blue = prev.b;
+
+    switch (GetRandomValue(0,2)) {
+        case 0:
+            red = GetRandomValue(prev.r - 1, prev.r + 1);
+            break;
+        case 1:
+            green = GetRandomValue(prev.g - 1, prev.g + 1);
+            break;
+        case 2:
+            blue = GetRandomValue(prev.b - 1, prev.b + 1);
+            break;
+        default:
+            break;
+    }
+
+    total = red + green + blue;
+
+    red = 255 * ((float)red/total);
+    green = 255 * ((float)green/total);
+    blue = 255 * ((float)blue/total);
+
+    newColor =  (Color) {
+        .r = red, 
+        .g = green,
+        .b = blue,
+        .a = 255,
+    };
+
+    vis->col2 = newColor; 
+
+
+    vis->out2Count = lowCap;
+    engine_ring(inner, vis->out2Count, 0.0f, 0.0f, w/2, h/2, radius/6, (float *)vis->out2);
+
+    // The trail moves on in whole analysis ticks of playback, so it is as
+    // long at any refresh rate; paused it stays put. Jumps back (seeks,
+    // track changes) count as one tick, long gaps fade it out completely.
+    double ticks = floor((t - vis->trailTime) * ANALYSIS_HZ + 0.5);
+    if (ticks < 1.0 && t > vis->trailTime - 1.0 / ANALYSIS_HZ) return;
+
+    if (ticks < 1.0 || ticks > 255.0) {
+        ticks = (ticks < 1.0) ? 1.0 : 255.0;
+        vis->trailTime = t;
+    } else {
+        vis->trailTime += ticks / ANALYSIS_HZ;
+    }
+
+    // Fade what is already in the trail and add the new outlines to it, at
+    // the alpha the first step of the old per-frame history had
+    gfx_trail_begin(w, h, 1.0f - powf(1.0f - TRAIL_FADE, (float)ticks), (int)ticks);
+        gfx_line_strip(vis->out, vis->outCount, Fade(vis->col, 100.0f / 255.0f));
+        gfx_line_strip(vis->out2, vis->out2Count, Fade(vis->col2, 80.0f / 255.0f));
+    gfx_trail_end();
+}
+
+void fft_visualize2(int w, int h)
+{
+    float radius = 2.3f*h/5.0f;
+
+    // Older outlines, faded, all in one textured quad
+    gfx_trail_draw();
+
+    if (vis->outCount == 0) return;
+
+    gfx_line_strip(vis->out, vis->outCount, vis->col);
+
+    Color circleColor = (Color) {
+        .r = vis->col.r,
+        .g = vis->col.g,
+        .b = vis->col.b,
+        .a = 40,
+    };
+
+    gfx_circle((float)w/2.0f, (float)h/2.0f, radius * 0.17f, circleColor);
+
+    gfx_line_strip(vis->out2, vis->out2Count, vis->col2);
+}
+
+void spectro_update(const Spectrum_Snapshot *s)
+{
+    // Adds the newest spectrum as one column of the waterfall. Only that
+    // column is uploaded; the history stays in the texture, which is used as
+    // a ring and scrolled when drawn.
+    bool soft = (vis->trailSoft != NULL);
+
+    if (vis->spectroPalette[255].a == 0) {
+        // Black through the fft_visualize colors to white
+        const Color stop[4] = { BLACK, {100, 0, 255, 255}, {255, 0, 100, 255}, WHITE };
+        const float at[4] = { 0.0f, 0.5f, 0.8f, 1.0f };
+
+        for (int i = 0; i < 256; i++)
+        {
+            float v = i / 255.0f;
+            int k = (v < at[1]) ? 0 : (v < at[2]) ? 1 : 2;
+            float f = (v - at[k]) / (at[k + 1] - at[k]);
+
+            vis->spectroPalette[i] = (Color) {
+                .r = (unsigned char)(stop[k].r + f * (stop[k + 1].r - stop[k].r)),
+                .g = (unsigned char)(stop[k].g + f * (stop[k + 1].g - stop[k].g)),
+                .b = (unsigned char)(stop[k].b + f * (stop[k + 1].b - stop[k].b)),
+                .a = 255,
+            };
+        }
+    }
+
+    if (soft && vis->spectroSoft == NULL) {
+        vis->spectroSoft = (Color *)malloc((size_t)SPECTRO_W * SPECTRO_H * sizeof(Color));
+        for (size_t i = 0; i < (size_t)SPECTRO_W * SPECTRO_H; i++) vis->spectroSoft[i] = BLACK;
+    }
+
+    if (!soft && vis->spectro.id == 0) {
+        Image img = GenImageColor(SPECTRO_W, SPECTRO_H, BLACK);
+        vis->spectro = LoadTextureFromImage(img);
+        UnloadImage(img);
+
+        // The draw reads past the right edge to scroll
+        SetTextureWrap(vis->spectro, TEXTURE_WRAP_REPEAT);
+    }
+
+    // Rows run from nyquist at the top down to SPECTRO_FMIN, evenly spaced
+    // in log frequency. Constant-Q bins are spaced that way already. The
+    // other modes lay out single FFT bins at the bottom before their bands
+    // grow geometrically, so rows are mapped through the FFT bin each one
+    // starts at instead. Each row shows the loudest band it covers.
+    size_t bins = s->bins;
+    bool cqt = (engine_mode(engine) == ANALYSIS_CQT);
+    float binLo = SPECTRO_FMIN * N / engine_rate(engine);
+    float octaves = log2f((N / 2) / binLo);
+
+    for (int row = 0; row < SPECTRO_H; row++)
+    {
+        size_t lo = (size_t)(SPECTRO_H - 1 - row) * bins / SPECTRO_H;
+        size_t hi = (size_t)(SPECTRO_H - row) * bins / SPECTRO_H;
+
+        if (!cqt) {
+            float a = binLo * exp2f(octaves * (SPECTRO_H - 1 - row) / SPECTRO_H);
+            float b = binLo * exp2f(octaves * (SPECTRO_H - row) / SPECTRO_H);
+            lo = engine_band_of(engine, (size_t)a);
+            hi = engine_band_of(engine, (size_t)ceilf(b) - 1) + 1;
+        }
+
+        if (hi <= lo) hi = lo + 1;
+        if (hi > bins) hi = bins;
+        if (lo >= hi) lo = hi - 1;
+
+        float v = 0.0f;
+        for (size_t i = lo; i < hi; i++)
+        {
+            float m = 0.5f * (s->logL[i] + s->logR[i]);
+            if (m > v) v = m;
+        }
+
+        vis->spectroColumn[row] = vis->spectroPalette[(int)(fminf(v, 1.0f) * 255.0f)];
+    }
+
+    if (soft) {
+        for (int row = 0; row < SPECTRO_H; row++)
+            vis->spectroSoft[(size_t)row * SPECTRO_W + vis->spectroHead] = vis->spectroColumn[row];
+    } else {
+        UpdateTextureRec(vis->spectro, (Rectangle){ (float)vis->spectroHead, 0, 1, SPECTRO_H }, vis->spectroColumn);
+    }
+
+    vis->spectroHead = (vis->spectroHead + 1) % SPECTRO_W;
+}
+
+void spectro_draw(int w, int h)
+{
+    // Oldest column (the one written next) at the left edge, newest at the
+    // right; the source rectangle starts there and wraps around
+    if (gfxSoft != NULL) {
+        if (vis->spectroSoft != NULL)
+            soft_push((Gfx_Cmd) {
+                .kind = GFX_IMAGE_SCROLL,
+                .b = (Vector2) { w, h },
+                .src = vis->spectroSoft,
+                .srcW = SPECTRO_W,
+                .srcH = SPECTRO_H,
+                .srcX = vis->spectroHead,
+            });
+        return;
+    }
+
+    if (vis->spectro.id == 0) return;
+
+    DrawTexturePro(
+        vis->spectro,
+        (Rectangle) { (float)vis->spectroHead, 0, SPECTRO_W, SPECTRO_H },
+        (Rectangle) { 0, 0, (float)w, (float)h },
+        (Vector2) { 0, 0 },
+        0.0f,
+        WHITE
+    );
+}
+
+void drawWave(int w, int h)
+{
+    float rectw = (float)w / SB;
+
+    Color c2 = (Color){0, 0, 255, 0};
+    Color c3 = (Color){200, 0, 55, 235};
+
+    if (rectw < 1.0f)
+    {
+        rectw = 1.0f;
+    }
+
+    // Newest SB samples of the displayed pair
+    float left[SB];
+    float right[SB];
+
+    engine_wave(engine, viewPos, left, right, SB);
+
+    for (size_t i = 0; i < SB; i++)
+    {
+        left[i] = fabsf(left[i]);
+        right[i] = fabsf(right[i]);
+    }
+
+    float max = 0.0f;
+
+    for (int i = 0; i < SB; i++)
+    {
+        if (left[i] > max)
+            max = left[i];
+        if (right[i] > max)
+            max = right[i];
+    }
+
+    for (size_t i = 0; i < SB; i++)
+    {
+        Rectangle rec = (Rectangle) {
+            .x = i * rectw,
+            .y = h + h / 2 - 1,
+            .width = rectw,
+            .height = h/2 * (left[i] / max)
+        };
+        
+        Rectangle rec2 = (Rectangle) {
+            .x = i * rectw,
+            .y = h + h / 2,
+            .width = rectw,
+            .height = h/2 * (right[i] / max)
+        };
+
+        gfx_rect_gradient_v(rec.x, rec.y, rec.width, rec.height, c3, c2);
+        gfx_rect_gradient_v(rec2.x, rec2.y - rec2.height, rec2.width, rec2.height, c2, c3);
+    }
+}
+
+void drawSongInfo(int w, int h)
+{
+    // Text needs the default font atlas, which lives on the GPU
+    if (gfxSoft != NULL) return;
+
+    const Track *track = tracklist_at(tl->currIdx);
+    float length = tracklist_length();
+    bool hasMeta = atomic_load_explicit(&track->hasMeta, memory_order_acquire);
+
+    if (songText == NULL || songText->path != track->file_path || songText->length != length || songText->hasMeta != hasMeta)
+        text_cache_build(track, length, hasMeta);
+
+    DrawTexture(songText->tex, w - songText->img.width/2, h, WHITE);
+}
+
+void text_cache_build(const Track *track, float length, bool hasMeta)
+{
+    // Title (file name until the tags are in), artist and album when
+    // tagged, then the extension and duration, centered under each other
+    const char *path = track->file_path;
+    Font font = GetFontDefault();
+    int fontSize = 24;
+    int spacing = 1;
+    int secs = (int)length;
+
+    char lines[3][256];
+    int count = 0;
+
+    const char *title = (hasMeta && track->title != NULL) ? track->title : GetFileNameWithoutExt(path);
+    snprintf(lines[count++], sizeof(lines[0]), "%s", title);
+
+    if (hasMeta && (track->artist != NULL || track->album != NULL)) {
+        if (track->artist != NULL && track->album != NULL)
+            snprintf(lines[count++], sizeof(lines[0]), "%s - %s", track->artist, track->album);
+        else
+            snprintf(lines[count++], sizeof(lines[0]), "%s", (track->artist != NULL) ? track->artist : track->album);
+    }
+
+    snprintf(lines[count++], sizeof(lines[0]), "%s - %d:%02d", GetFileExtension(path), secs / 60, secs % 60);
+
+    Image text[3];
+    int width = 0;
+    int height = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        text[i] = ImageTextEx(font, lines[i], fontSize, spacing, WHITE);
+        if (text[i].width > width) width = text[i].width;
+        height += text[i].height;
+    }
+
+    if (songText == NULL) {
+        songText = (Text_Cache *)malloc(sizeof(Text_Cache));
+        memset(songText, 0, sizeof(Text_Cache));
+    } else {
+        UnloadTexture(songText->tex);
+        UnloadImage(songText->img);
+    }
+
+    songText->img = GenImageColor(width, height, BLANK);
+
+    int y = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ImageDraw(
+            &songText->img,
+            text[i],
+            (Rectangle) { 0, 0, text[i].width, text[i].height },
+            (Rectangle) { (width - text[i].width) / 2, y, text[i].width, text[i].height },
+            WHITE
+        );
+        y += text[i].height;
+        UnloadImage(text[i]);
+    }
+
+    songText->tex = LoadTextureFromImage(songText->img);
+    songText->path = path;
+    songText->length = length;
+    songText->hasMeta = hasMeta;
+}
+
+void text_cache_free()
+{
+    if (songText == NULL) return;
+
+    UnloadTexture(songText->tex);
+    UnloadImage(songText->img);
+    free(songText);
+    songText = NULL;
+}
+
+void drawScene(double t, int w, int h, bool showWave, bool showFFT, bool showFFT2, bool showSpectro, bool isMusicLoaded)
+{
+    const Spectrum_Snapshot *newest = engine_snapshot(engine, 0);
+    const Spectrum_Snapshot *older = engine_snapshot(engine, 1);
+
+    if (showWave)
+        drawWave(w, h/2);
+
+    if (showFFT)
+    {
+        fft_visualize(older, newest, t, w, h/2);
+    }
+
+    if (showFFT2)
+    {
+        //BeginShaderMode(shader);
+            fft_visualize2(w, h);
+        //EndShaderMode();
+    }
+
+    if (showSpectro)
+        spectro_draw(w, h);
+
+    if (isMusicLoaded) {
+        if (showFFT2) drawSongInfo(w/2, h/10);
+        else drawSongInfo(w/2, h/2);
+    }
+}
+
+void view_select(size_t v, bool *showWave, bool *showFFT, bool *showFFT2, bool *showSpectro)
+{
+    // Views cycled through with KEY_Q
+    *showWave = (v == 0 || v == 2);
+    *showFFT = (v == 0 || v == 1);
+    *showFFT2 = (v == 3);
+    *showSpectro = (v == 4);
+}
+
+void gfx_line(Vector2 a, Vector2 b, float thick, Color c)
+{
+    if (gfxSoft == NULL) {
+        DrawLineEx(a, b, thick, c);
+        return;
+    }
+
+    soft_push((Gfx_Cmd) { .kind = GFX_LINE, .a = a, .b = b, .thick = thick, .c0 = c });
+}
+
+void gfx_line_strip(const Vector2 *pts, int n, Color c)
+{
+    if (gfxSoft == NULL) {
+        DrawLineStrip((Vector2 *)pts, n, c);
+        return;
+    }
+
+    for (int i = 0; i + 1 < n; i++)
+        soft_push((Gfx_Cmd) { .kind = GFX_LINE, .a = pts[i], .b = pts[i + 1], .thick = 1.0f, .c0 = c });
+}
+
+void gfx_rect_gradient_v(int x, int y, int w, int h, Color top, Color bottom)
+{
+    if (gfxSoft == NULL) {
+        DrawRectangleGradientV(x, y, w, h, top, bottom);
+        return;
+    }
+
+    soft_push((Gfx_Cmd) {
+        .kind = GFX_RECT_GRADIENT_V,
+        .a = (Vector2) { x, y },
+        .b = (Vector2) { w, h },
+        .c0 = top,
+        .c1 = bottom,
+    });
+}
+
+void gfx_circle(int cx, int cy, float r, Color c)
+{
+    if (gfxSoft == NULL) {
+        DrawCircle(cx, cy, r, c);
+        return;
+    }
+
+    soft_push((Gfx_Cmd) { .kind = GFX_CIRCLE, .a = (Vector2) { cx, cy }, .b = (Vector2) { r, 0 }, .c0 = c });
+}
+
+Soft_Canvas *soft_create(int w, int h, bool threaded)
+{
+    Soft_Canvas *sc = (Soft_Canvas *)malloc(sizeof(Soft_Canvas));
+    memset(sc, 0, sizeof(Soft_Canvas));
+
+    sc->w = w;
+    sc->h = h;
+    sc->px = (Color *)malloc((size_t)w * h * sizeof(Color));
+    sc->threaded = threaded;
+
+    return sc;
+}
+
+void soft_free(Soft_Canvas *sc)
+{
+    free(sc->px);
+    free(sc->cmd);
+    free(sc);
+}
+
+void soft_begin(Soft_Canvas *sc, Color clear)
+{
+    sc->clear = clear;
+    sc->fade = 0.0f;
+    sc->count = 0;
+    gfxSoft = sc;
+}
+
+void soft_push(Gfx_Cmd cmd)
+{
+    Soft_Canvas *sc = gfxSoft;
+
+    if (sc->count == sc->cap) {
+        sc->cap = (sc->cap == 0) ? 4096 : sc->cap * 2;
+        sc->cmd = (Gfx_Cmd *)realloc(sc->cmd, sc->cap * sizeof(Gfx_Cmd));
+    }
+
+    sc->cmd[sc->count++] = cmd;
+}
+
+void soft_blend(Color *d, Color c, float cov)
+{
+    // Source over, with the color's alpha scaled by the pixel coverage
+    int a = (int)(c.a * cov + 0.5f);
+    int inv = 255 - a;
+
+    d->r = (c.r * a + d->r * inv + 127) / 255;
+    d->g = (c.g * a + d->g * inv + 127) / 255;
+    d->b = (c.b * a + d->b * inv + 127) / 255;
+    d->a = (255 * a + d->a * inv + 127) / 255;
+}
+
+void soft_span(Color *d, int n, Color c)
+{
+    // Blend one color over a run of pixels: out = (src * a + dst * (255 - a)) / 255
+    int a = c.a;
+    int inv = 255 - a;
+    int i = 0;
+
+    if (a == 255) {
+        for (; i < n; i++) d[i] = c;
+        return;
+    }
+
+#ifdef __SSE2__
+    // Four pixels per step as 16 bit lanes, x / 255 as (x + 128 + ((x + 128) >> 8)) >> 8
+    __m128i zero = _mm_setzero_si128();
+    __m128i vinv = _mm_set1_epi16((short)inv);
+    __m128i vsrc = _mm_setr_epi16(c.r * a, c.g * a, c.b * a, 255 * a, c.r * a, c.g * a, c.b * a, 255 * a);
+    __m128i round = _mm_set1_epi16(128);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+
+        lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, vinv), vsrc), round);
+        hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, vinv), vsrc), round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+        _mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < n; i++)
+        soft_blend(&d[i], c, 1.0f);
+}
+
+void soft_raster_line(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1)
+{
+    // Thick line as a capsule around the segment, coverage from the distance
+    // to the segment with a one pixel falloff for antialiasing
+    Vector2 a = cmd->a;
+    Vector2 b = cmd->b;
+    float r = cmd->thick * 0.5f;
+    float reach = r + 0.5f;
+
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float len2 = dx * dx + dy * dy;
+
+    int top = (int)floorf(fminf(a.y, b.y) - reach);
+    int bottom = (int)ceilf(fmaxf(a.y, b.y) + reach);
+    int left = (int)floorf(fminf(a.x, b.x) - reach);
+    int right = (int)ceilf(fmaxf(a.x, b.x) + reach);
+
+    if (top < y0) top = y0;
+    if (bottom > y1) bottom = y1;
+    if (left < 0) left = 0;
+    if (right > sc->w) right = sc->w;
+
+    for (int y = top; y < bottom; y++)
+    {
+        float py = y + 0.5f;
+        int x0 = left;
+        int x1 = right;
+
+        // Narrow the row to the band |normal . (p - a)| <= reach
+        if (len2 > 0.0f && fabsf(dy) > 1e-6f) {
+            float len = sqrtf(len2);
+            float nx = -dy / len;
+            float ny = dx / len;
+            float base = ny * (py - a.y);
+            float xa = a.x + (-reach - base) / nx;
+            float xb = a.x + (reach - base) / nx;
+            int s0 = (int)floorf(fminf(xa, xb) - 0.5f);
+            int s1 = (int)ceilf(fmaxf(xa, xb) + 0.5f);
+            if (s0 > x0) x0 = s0;
+            if (s1 < x1) x1 = s1;
+        }
+
+        Color *row = sc->px + (size_t)y * sc->w;
+        for (int x = x0; x < x1; x++)
+        {
+            float px = x + 0.5f;
+            float t = (len2 > 0.0f) ? ((px - a.x) * dx + (py - a.y) * dy) / len2 : 0.0f;
+            t = fminf(fmaxf(t, 0.0f), 1.0f);
+
+            float ex = px - (a.x + t * dx);
+            float ey = py - (a.y + t * dy);
+            float cov = reach - sqrtf(ex * ex + ey * ey);
+
+            if (cov > 0.0f)
+                soft_blend(&row[x], cmd->c0, fminf(cov, 1.0f));
+        }
+    }
+}
+
+void soft_raster_rect(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1)
+{
+    int x = (int)cmd->a.x;
+    int y = (int)cmd->a.y;
+    int w = (int)cmd->b.x;
+    int h = (int)cmd->b.y;
+
+    if (w <= 0 || h <= 0) return;
+
+    int top = (y < y0) ? y0 : y;
+    int bottom = (y + h > y1) ? y1 : y + h;
+    int left = (x < 0) ? 0 : x;
+    int right = (x + w > sc->w) ? sc->w : x + w;
+
+    if (right <= left) return;
+
+    for (int r = top; r < bottom; r++)
+    {
+        // Vertical gradient: one color per row, filled as a span
+        float t = (h > 1) ? (float)(r - y) / (h - 1) : 0.0f;
+        Color c = {
+            cmd->c0.r + (cmd->c1.r - cmd->c0.r) * t,
+            cmd->c0.g + (cmd->c1.g - cmd->c0.g) * t,
+            cmd->c0.b + (cmd->c1.b - cmd->c0.b) * t,
+            cmd->c0.a + (cmd->c1.a - cmd->c0.a) * t,
+        };
+
+        if (c.a == 0) continue;
+        soft_span(sc->px + (size_t)r * sc->w + left, right - left, c);
+    }
+}
+
+void soft_raster_circle(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1)
+{
+    float cx = cmd->a.x;
+    float cy = cmd->a.y;
+    float r = cmd->b.x;
+
+    int top = (int)floorf(cy - r - 1.0f);
+    int bottom = (int)ceilf(cy + r + 1.0f);
+    if (top < y0) top = y0;
+    if (bottom > y1) bottom = y1;
+
+    for (int y = top; y < bottom; y++)
+    {
+        float dy = y + 0.5f - cy;
+        float outer2 = (r + 0.5f) * (r + 0.5f) - dy * dy;
+        if (outer2 <= 0.0f) continue;
+
+        // Fully covered interior as one span, coverage per pixel on the rim
+        float outer = sqrtf(outer2);
+        float inner2 = (r - 0.5f) * (r - 0.5f) - dy * dy;
+        float inner = (inner2 > 0.0f) ? sqrtf(inner2) : 0.0f;
+
+        int x0 = (int)floorf(cx - outer);
+        int x1 = (int)ceilf(cx + outer);
+        int i0 = (int)ceilf(cx - inner - 0.5f);
+        int i1 = (int)floorf(cx + inner - 0.5f) + 1;
+        if (x0 < 0) x0 = 0;
+        if (x1 > sc->w) x1 = sc->w;
+        if (i0 < x0) i0 = x0;
+        if (i1 > x1) i1 = x1;
+        if (inner <= 0.0f) i1 = i0;
+
+        Color *row = sc->px + (size_t)y * sc->w;
+
+        for (int x = x0; x < x1; x++)
+        {
+            if (x == i0 && i1 > i0) {
+                soft_span(row + i0, i1 - i0, cmd->c0);
+                x = i1 - 1;
+                continue;
+            }
+
+            float dx = x + 0.5f - cx;
+            float cov = r + 0.5f - sqrtf(dx * dx + dy * dy);
+            if (cov > 0.0f)
+                soft_blend(&row[x], cmd->c0, fminf(cov, 1.0f));
+        }
+    }
+}
+
+void soft_raster_image_add(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1)
+{
+    // Saturating add of the source colors, like BLEND_ADD_COLORS
+    for (int y = y0; y < y1; y++)
+    {
+        Color *d = sc->px + (size_t)y * sc->w;
+        const Color *s = cmd->src + (size_t)y * sc->w;
+        int x = 0;
+
+#ifdef __SSE2__
+        for (; x + 4 <= sc->w; x += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(d + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + x));
+            _mm_storeu_si128((__m128i *)(d + x), _mm_adds_epu8(a, b));
+        }
+#endif
+
+        for (; x < sc->w; x++)
+        {
+            d[x].r = (d[x].r + s[x].r > 255) ? 255 : d[x].r + s[x].r;
+            d[x].g = (d[x].g + s[x].g > 255) ? 255 : d[x].g + s[x].g;
+            d[x].b = (d[x].b + s[x].b > 255) ? 255 : d[x].b + s[x].b;
+        }
+    }
+}
+
+void soft_raster_image_scroll(Soft_Canvas *sc, const Gfx_Cmd *cmd, int y0, int y1)
+{
+    // Nearest sample of src stretched over the rect at a, starting at
+    // column srcX and wrapping around, like a repeat-wrapped texture
+    int rx = (int)cmd->a.x;
+    int ry = (int)cmd->a.y;
+    int rw = (int)cmd->b.x;
+    int rh = (int)cmd->b.y;
+    if (rw <= 0 || rh <= 0) return;
+
+    int ya = (ry > y0) ? ry : y0;
+    int yb = (ry + rh < y1) ? ry + rh : y1;
+    int xa = (rx > 0) ? rx : 0;
+    int xb = (rx + rw < sc->w) ? rx + rw : sc->w;
+
+    for (int y = ya; y < yb; y++)
+    {
+        Color *d = sc->px + (size_t)y * sc->w;
+        const Color *s = cmd->src + (size_t)((y - ry) * cmd->srcH / rh) * cmd->srcW;
+
+        for (int x = xa; x < xb; x++)
+            d[x] = s[(cmd->srcX + (x - rx) * cmd->srcW / rw) % cmd->srcW];
+    }
+}
+
+void soft_band_job(void *ctx, int job)
+{
+    Soft_Canvas *sc = ctx;
+    int y0 = sc->h * job / SOFT_BANDS;
+    int y1 = sc->h * (job + 1) / SOFT_BANDS;
+
+    if (sc->fade > 0.0f) {
+        // Truncating keeps fading all the way down to black
+        int keep = (int)((1.0f - sc->fade) * 256.0f);
+
+        for (int y = y0; y < y1; y++)
+        {
+            Color *row = sc->px + (size_t)y * sc->w;
+            for (int x = 0; x < sc->w; x++)
+            {
+                row[x].r = (row[x].r * keep) >> 8;
+                row[x].g = (row[x].g * keep) >> 8;
+                row[x].b = (row[x].b * keep) >> 8;
+            }
+        }
+    } else {
+        for (int y = y0; y < y1; y++)
+        {
+            Color *row = sc->px + (size_t)y * sc->w;
+            for (int x = 0; x < sc->w; x++) row[x] = sc->clear;
+        }
+    }
+
+    // Commands in recording order, so overlapping draws blend like on the GPU
+    for (size_t i = 0; i < sc->count; i++)
+    {
+        const Gfx_Cmd *cmd = &sc->cmd[i];
+
+        switch (cmd->kind)
+        {
+            case GFX_LINE:
+                soft_raster_line(sc, cmd, y0, y1);
+                break;
+            case GFX_RECT_GRADIENT_V:
+                soft_raster_rect(sc, cmd, y0, y1);
+                break;
+            case GFX_CIRCLE:
+                soft_raster_circle(sc, cmd, y0, y1);
+                break;
+            case GFX_IMAGE_ADD:
+                soft_raster_image_add(sc, cmd, y0, y1);
+                break;
+            case GFX_IMAGE_SCROLL:
+                soft_raster_image_scroll(sc, cmd, y0, y1);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void soft_flush(Soft_Canvas *sc)
+{
+    if (sc->threaded) {
+        engine_pool_run(engine, soft_band_job, sc, SOFT_BANDS);
+    } else {
+        for (int j = 0; j < SOFT_BANDS; j++)
+            soft_band_job(sc, j);
+    }
+
+    gfxSoft = NULL;
+}
+
+void gfx_trail_begin(int w, int h, float fade, int step)
+{
+    // Draws until gfx_trail_end() go into the trail, after fading it. The
+    // old contents are scaled by 1 - fade and then lose step more (out of
+    // 255), so the fade never stalls on rounding and ends at black.
+    if (vis->trailSoft != NULL) {
+        soft_begin(vis->trailSoft, BLACK);
+        vis->trailSoft->fade = fade;
+        return;
+    }
+
+    if (vis->trail.id == 0 || vis->trail.texture.width != w || vis->trail.texture.height != h) {
+        if (vis->trail.id != 0) UnloadRenderTexture(vis->trail);
+
+        vis->trail = LoadRenderTexture(w, h);
+        BeginTextureMode(vis->trail);
+            ClearBackground(BLACK);
+        EndTextureMode();
+    }
+
+    // An 8-bit target rounds dst * (1 - fade) back up once dst is small,
+    // (about 8 at TRAIL_FADE), the subtracted step takes it the rest of
+    // the way. The soft canvas truncates instead, which does the same.
+    unsigned char s = (unsigned char)((step < 255) ? step : 255);
+
+    BeginTextureMode(vis->trail);
+    DrawRectangle(0, 0, w, h, Fade(BLACK, fade));
+
+    rlSetBlendFactors(RL_ONE, RL_ONE, RL_FUNC_REVERSE_SUBTRACT);
+    BeginBlendMode(BLEND_CUSTOM);
+        DrawRectangle(0, 0, w, h, (Color){ s, s, s, 0 });
+    EndBlendMode();
+}
+
+void gfx_trail_end()
+{
+    if (vis->trailSoft != NULL) {
+        soft_flush(vis->trailSoft);
+        return;
+    }
+
+    EndTextureMode();
+}
 
-    Color newColor =  (Color) {
-        .r = red, 
-        .g = green,
-        .b = blue,
-        .a = 255,
-    };
+void gfx_trail_draw()
+{
+    // The trail is black where nothing was drawn, so adding it only lights
+    // up the outlines
+    if (gfxSoft != NULL) {
+        if (vis->trailSoft != NULL && vis->trailSoft->w == gfxSoft->w && vis->trailSoft->h == gfxSoft->h)
+            soft_push((Gfx_Cmd) { .kind = GFX_IMAGE_ADD, .src = vis->trailSoft->px });
+        return;
+    }
 
-    vis->col[0] = newColor; 
-    
-    // Save fft data to most recent visualization buffer 
-    for (size_t i = lowCap; i < frames; i++)
-    {
-        if (i == (frames-1)) {
-            vis->out[0][frames-lowCap-1] = vis->out[0][0];
-            break;
-        }
-        
-        float angle = (2.0f * PI * (i-lowCap)) / (frames-lowCap);
+    if (vis->trail.id == 0) return;
 
-        float val = 0.0f;;
-        
-        if (fft->out_logL[i] < 0.20f) {
-            val = 0.17f;
-        } else {
-            val = fft->out_logL[i];
-        }
+    BeginBlendMode(BLEND_ADD_COLORS);
+        DrawTextureRec(
+            vis->trail.texture,
+            (Rectangle) { 0, 0, (float)vis->trail.texture.width, (float)-vis->trail.texture.height },
+            (Vector2) { 0, 0 },
+            WHITE
+        );
+    EndBlendMode();
+}
 
-        vis->out[0][i-lowCap] = (Vector2) {
-            .x =  w/2 + radius * val * cosf(angle),
-            .y =  h/2 + radius * val * sinf(angle),
-        };        
+int headless_run(const char *path, const char *prefix, size_t view)
+{
+    // Decoded entirely on the CPU, converted to the float stereo frames the
+    // tap normally gets from the audio device
+    Wave wave = LoadWave(path);
+    if (wave.frameCount == 0) {
+        printf("ERROR: Could not load %s\n", path);
+        return 1;
     }
 
-    // Swap newer visualization data buffers with older ones, keeping track of
-    // past VB frames of data
-    for (int i = VB - 1; i >= 1; i--) {
-        memmove(vis->out[i], vis->out[i-1], sizeof(Vector2) * (frames-lowCap));
-        memmove(&vis->col[i], &vis->col[i-1], sizeof(Color));
+    // Native channel layout, up to what the tap keeps rings for
+    unsigned int channels = (wave.channels <= TAP_MAX_CHANNELS) ? wave.channels : 2;
+    WaveFormat(&wave, wave.sampleRate, 32, channels);
+    float *samples = LoadWaveSamples(wave);
+
+    audioBuff_init(wave.sampleRate, channels);
+
+    bool showWave;
+    bool showFFT;
+    bool showFFT2;
+    bool showSpectro;
+    view_select(view, &showWave, &showFFT, &showFFT2, &showSpectro);
+
+    int w = 1024;
+    int h = 900;
+    engine_set_bands(engine, w);
+    Soft_Canvas *sc = soft_create(w, h, true);
+    vis->trailSoft = soft_create(w, h, true);
+    memset(vis->trailSoft->px, 0, (size_t)w * h * sizeof(Color));
+
+    // A video file as the prefix streams the frames to the encoder instead
+    Recorder *rec = NULL;
+    if (IsFileExtension(prefix, ".mp4;.mkv;.mov")) {
+        rec = recorder_start(prefix, w, h, ANALYSIS_HZ, path, 0.0, false);
+        if (rec == NULL) {
+            soft_free(sc);
+            UnloadWaveSamples(samples);
+            UnloadWave(wave);
+            audioBuff_free();
+            return 1;
+        }
     }
 
-    // Draw all visualization data buffers and bring alpha value down as data
-    // gets older for fading effect
+    Image img = {
+        .data = sc->px,
+        .width = w,
+        .height = h,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
 
-    DrawLineStrip(vis->out[0], frames-lowCap, vis->col[0]);
-    
-    for (int i = 1; i < VB; i++) {
-        float frac = (float)i / VB;
-        
-        vis->col[i].a = (1-frac) * 100;
+    size_t hop = (size_t)(wave.sampleRate / ANALYSIS_HZ);
+    size_t frame = 0;
+    size_t pushed = 0;
+    double t0 = wall_time();
 
-        DrawLineStrip(vis->out[i], frames-lowCap, vis->col[i]);
+    for (size_t pos = 0; pos + hop <= wave.frameCount; pos += hop, frame++)
+    {
+        // Every window is centered on the current position, so the tap is
+        // fed half a window ahead of it
+        size_t want = (pos + hop + N / 2 < wave.frameCount) ? pos + hop + N / 2 : wave.frameCount;
+        engine_push(engine, samples + pushed * channels, want - pushed);
+        pushed = want;
+        viewPos = pos + hop;
+
+        double t = (double)(pos + hop) / wave.sampleRate;
+        engine_analyze_at(engine, t, viewPos);
+
+        if (showFFT2)
+            trail_update(engine_snapshot(engine, 1), engine_snapshot(engine, 0), t, w, h);
+        if (showSpectro)
+            spectro_update(engine_snapshot(engine, 0));
+
+        soft_begin(sc, BLACK);
+        drawScene(t, w, h, showWave, showFFT, showFFT2, showSpectro, false);
+        soft_flush(sc);
+
+        if (rec != NULL) {
+            // Offline: wait for the encoder rather than drop frames
+            double c0 = wall_time();
+            Color *px = (Color *)malloc((size_t)w * h * sizeof(Color));
+            memcpy(px, sc->px, (size_t)w * h * sizeof(Color));
+            recorder_push(rec, px, 1, true);
+
+            double dt = wall_time() - c0;
+            rec->captureSum += dt;
+            if (dt > rec->captureMax) rec->captureMax = dt;
+        } else {
+            ExportImage(img, TextFormat("%s%05zu.png", prefix, frame));
+        }
     }
 
-    // Repeat steps for internal visualization
+    if (rec != NULL)
+        recorder_stop(rec);
 
-    Color circleColor = (Color) {
-        .r = vis->col[0].r,
-        .g = vis->col[0].g,
-        .b = vis->col[0].b,
-        .a = 40,
-    };
+    double t1 = wall_time();
+    printf("INFO: HEADLESS %zu frames in %.2f s (%.1f fps, %.1fx realtime)\n", frame, t1 - t0,
+        frame / fmax(t1 - t0, 1e-9), frame / ANALYSIS_HZ / fmax(t1 - t0, 1e-9));
 
-    DrawCircle((float)w/2.0f, (float)h/2.0f, radius * 0.17f, circleColor);
+    soft_free(sc);
+    UnloadWaveSamples(samples);
+    UnloadWave(wave);
+    audioBuff_free();
 
-    prev = vis->col2[0];
+    return 0;
+}
 
-    red = prev.r;
-    green = prev.g;
-    blue = prev.b;
+Recorder *recorder_start(const char *path, int w, int h, double fps, const char *audio, double audioOffset, bool flip)
+{
+    // Raw frames on stdin, audio taken from the track itself starting at
+    // the position playback was at when recording began
+    char size[32];
+    char rate[32];
+    char offset[32];
+    snprintf(size, sizeof(size), "%dx%d", w, h);
+    snprintf(rate, sizeof(rate), "%.3f", fps);
+    snprintf(offset, sizeof(offset), "%.3f", audioOffset);
+
+    const char *argv[40];
+    int argc = 0;
+    const char *video[] = { "ffmpeg", "-loglevel", "error", "-y", "-f", "rawvideo", "-pix_fmt", "rgba",
+        "-s", size, "-r", rate, "-i", "-" };
+    for (size_t i = 0; i < sizeof(video) / sizeof(video[0]); i++) argv[argc++] = video[i];
+
+    if (audio != NULL) {
+        const char *track[] = { "-ss", offset, "-i", audio, "-map", "0:v", "-map", "1:a", "-c:a", "aac", "-shortest" };
+        for (size_t i = 0; i < sizeof(track) / sizeof(track[0]); i++) argv[argc++] = track[i];
+    }
 
-    switch (GetRandomValue(0,2)) {
-        case 0:
-            red = GetRandomValue(prev.r - 1, prev.r + 1);
-            break;
-        case 1:
-            green = GetRandomValue(prev.g - 1, prev.g + 1);
-            break;
-        case 2:
-            blue = GetRandomValue(prev.b - 1, prev.b + 1);
-            break;
-        default:
-            break;
+    // Render textures are read back bottom-up
+    if (flip) {
+        argv[argc++] = "-vf";
+        argv[argc++] = "vflip";
     }
 
-    total = red + green + blue;
+    const char *out[] = { "-c:v", "libx264", "-preset", "veryfast", "-pix_fmt", "yuv420p", path };
+    for (size_t i = 0; i < sizeof(out) / sizeof(out[0]); i++) argv[argc++] = out[i];
+    argv[argc] = NULL;
+
+#ifndef _WIN32
+    // A failing encoder should end the recording, not the program
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    intptr_t encoder = 0;
+    FILE *pipe = encoder_spawn(argv, &encoder);
+    if (pipe == NULL) {
+        printf("ERROR: Could not start encoder (ffmpeg) for %s\n", path);
+        return NULL;
+    }
 
-    red = 255 * ((float)red/total);
-    green = 255 * ((float)green/total);
-    blue = 255 * ((float)blue/total);
+    Recorder *rec = (Recorder *)malloc(sizeof(Recorder));
+    memset(rec, 0, sizeof(Recorder));
 
-    newColor =  (Color) {
-        .r = red, 
-        .g = green,
-        .b = blue,
-        .a = 255,
-    };
+    rec->pipe = pipe;
+    rec->encoder = encoder;
+    rec->w = w;
+    rec->h = h;
+    rec->fps = fps;
+    rec->start = wall_time();
 
-    vis->col2[0] = newColor; 
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->notEmpty, NULL);
+    pthread_cond_init(&rec->notFull, NULL);
+    pthread_create(&rec->thread, NULL, recorder_writer, rec);
 
+    printf("INFO: RECORD Started %s (%dx%d @ %.1f fps)\n", path, w, h, fps);
+
+    return rec;
+}
 
-    for (size_t i = 0; i < lowCap; i++)
+FILE *encoder_spawn(const char **argv, intptr_t *proc)
+{
+    // The encoder is started from an argument vector, never through a
+    // shell, so file names (dropped tracks included) can't be read as
+    // commands. The returned stream is the encoder's stdin.
+    int fds[2];
+
+#ifdef _WIN32
+    // _spawnvp joins the arguments with spaces, so those with spaces are
+    // quoted. Windows file names can't contain quotes themselves.
+    const char *args[64];
+    char *owned[64];
+    size_t n = 0;
+    size_t nOwned = 0;
+    bool ok = true;
+
+    for (; argv[n] != NULL && n < 63; n++)
     {
-        if (i == (lowCap-1)) {
-            vis->out2[0][lowCap-1] = vis->out2[0][0];
-            break;
+        args[n] = argv[n];
+        if (strchr(argv[n], '"') != NULL) ok = false;
+        if (strchr(argv[n], ' ') == NULL) continue;
+
+        size_t len = strlen(argv[n]);
+        char *q = (char *)malloc(len + 3);
+        q[0] = '"';
+        memcpy(q + 1, argv[n], len);
+        q[len + 1] = '"';
+        q[len + 2] = '\0';
+        args[n] = owned[nOwned++] = q;
+    }
+    args[n] = NULL;
+
+    FILE *pipe = NULL;
+    if (ok && _pipe(fds, 1 << 20, _O_BINARY | _O_NOINHERIT) == 0) {
+        // The child inherits stdin, so the read end stands in for it while
+        // spawning
+        int saved = _dup(0);
+        _dup2(fds[0], 0);
+        intptr_t child = _spawnvp(_P_NOWAIT, args[0], args);
+        _dup2(saved, 0);
+        _close(saved);
+        _close(fds[0]);
+
+        if (child == -1) {
+            _close(fds[1]);
+        } else {
+            *proc = child;
+            pipe = _fdopen(fds[1], "wb");
         }
+    }
 
-        float angle = (2.0f * PI * i) / (lowCap);
+    for (size_t i = 0; i < nOwned; i++) free(owned[i]);
 
-        float val = 0.0f;;
-        val = fft->out_logL[i];
-        
-        vis->out2[0][i] = (Vector2) {
-            .x =  w/2 + radius/6 * val * cosf(angle),
-            .y =  h/2 + radius/6 * val * sinf(angle),
-        };        
-    }
+    return pipe;
+#else
+    extern char **environ;
 
-    for (int i = VB - 1; i >= 1; i--) {
-        memmove(vis->out2[i], vis->out2[i-1], sizeof(Vector2) * lowCap);
-        memmove(&vis->col2[i], &vis->col2[i-1], sizeof(Color));
-    }
+    if (pipe(fds) != 0) return NULL;
 
-    DrawLineStrip(vis->out2[0], lowCap, vis->col2[0]);
-    
-    for (int i = 1; i < VB; i++) {
-        float frac = (float)i / VB;
-        
-        vis->col2[i].a = (1-frac) * 80;
+    // Only the child's stdin may keep the pipe open, or the encoder would
+    // never see the end of its input
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+
+    pid_t child;
+    int err = posix_spawnp(&child, argv[0], &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[0]);
 
-        DrawLineStrip(vis->out2[i], lowCap, vis->col2[i]);
+    if (err != 0) {
+        close(fds[1]);
+        return NULL;
     }
-    
+
+    *proc = (intptr_t)child;
+    return fdopen(fds[1], "w");
+#endif
 }
 
-void drawWave(int w, int h)
+void encoder_close(FILE *pipe, intptr_t proc)
 {
-    float rectw = (float)w / SB;
+    // Closing stdin ends the encoder's input, it finishes the file and exits
+    fclose(pipe);
+
+#ifdef _WIN32
+    int status;
+    _cwait(&status, proc, 0);
+#else
+    int status;
+    waitpid((pid_t)proc, &status, 0);
+#endif
+}
 
-    Color c2 = (Color){0, 0, 255, 0};
-    Color c3 = (Color){200, 0, 55, 235};
+void *recorder_writer(void *arg)
+{
+    Recorder *rec = arg;
+    size_t bytes = (size_t)rec->w * rec->h * sizeof(Color);
 
-    if (rectw < 1.0f)
+    pthread_mutex_lock(&rec->lock);
+
+    for (;;)
     {
-        rectw = 1.0f;
-    }
+        while (rec->head == rec->tail && !rec->quit)
+            pthread_cond_wait(&rec->notEmpty, &rec->lock);
+
+        // Drain everything queued before honoring quit
+        if (rec->head == rec->tail) break;
+
+        Color *px = rec->slot[rec->head % REC_QUEUE];
+        int repeat = rec->repeat[rec->head % REC_QUEUE];
+        pthread_mutex_unlock(&rec->lock);
+
+        // The pipe write blocks while the encoder catches up, outside the lock
+        double t0 = wall_time();
+        for (int i = 0; i < repeat && !rec->broken; i++)
+            if (fwrite(px, 1, bytes, rec->pipe) != bytes) {
+                printf("ERROR: RECORD Encoder stopped accepting frames\n");
+                rec->broken = true;
+            }
+        double t1 = wall_time();
 
-    float max = 0.0f;
+        free(px);
 
-    for (int i = 0; i < SB; i++)
-    {
-        if (cabsf(aBuff->left[i]) > max)
-            max = cabsf(aBuff->left[i]);
-        if (cabsf(aBuff->right[i]) > max)
-            max = cabsf(aBuff->right[i]);
+        pthread_mutex_lock(&rec->lock);
+        rec->head++;
+        rec->written += repeat;
+        rec->writeSum += t1 - t0;
+        pthread_cond_signal(&rec->notFull);
     }
 
-    for (size_t i = 0; i < SB; i++)
-    {
-        Rectangle rec = (Rectangle) {
-            .x = i * rectw,
-            .y = h + h / 2 - 1,
-            .width = rectw,
-            .height = h/2 * (cabsf(aBuff->left[i]) / max)
-        };
-        
-        Rectangle rec2 = (Rectangle) {
-            .x = i * rectw,
-            .y = h + h / 2,
-            .width = rectw,
-            .height = h/2 * (cabsf(aBuff->right[i]) / max)
-        };
+    pthread_mutex_unlock(&rec->lock);
+
+    return NULL;
+}
 
-        DrawRectangleGradientV(rec.x, rec.y, rec.width, rec.height, c3, c2);
-        DrawRectangleGradientV(rec2.x, rec2.y - rec2.height, rec2.width, rec2.height, c2, c3);
+bool recorder_push(Recorder *rec, Color *px, int repeat, bool block)
+{
+    // Takes ownership of px. Without block a full queue drops the frame and
+    // the next one is written that many more times, so the video keeps its
+    // length (and audio sync) and only stutters.
+    pthread_mutex_lock(&rec->lock);
+
+    while (block && rec->tail - rec->head == REC_QUEUE)
+        pthread_cond_wait(&rec->notFull, &rec->lock);
+
+    if (rec->tail - rec->head == REC_QUEUE) {
+        rec->owed += repeat;
+        rec->dropped++;
+        pthread_mutex_unlock(&rec->lock);
+        free(px);
+        return false;
     }
+
+    rec->slot[rec->tail % REC_QUEUE] = px;
+    rec->repeat[rec->tail % REC_QUEUE] = repeat + rec->owed;
+    rec->owed = 0;
+    rec->tail++;
+    rec->pushed++;
+    pthread_cond_signal(&rec->notEmpty);
+    pthread_mutex_unlock(&rec->lock);
+
+    return true;
 }
 
-void drawSongInfo(int w, int h)
+void recorder_capture(Recorder *rec, Texture2D tex)
 {
-    Font font = GetFontDefault();
-    int fontSize = 24;
-    int spacing = 1;
-    const char *fileName = GetFileNameWithoutExt(tl->tracks[tl->currIdx].file_path);
-    const char *fileExt = GetFileExtension(tl->tracks[tl->currIdx].file_path);
-            
-    Vector2 fileNameV = MeasureTextEx(font, fileName, fontSize, spacing);
-    Vector2 fileExtV = MeasureTextEx(font, fileExt, fontSize, spacing);
-            
-    DrawTextEx(
-        font,
-        fileName,
-        (Vector2) {
-            .x = w-fileNameV.x/2,
-            .y = h,
-        },
-        fontSize,
-        spacing,
-        WHITE
-    );
-    DrawTextEx(
-        font,
-        fileExt,
-        (Vector2) {
-            .x = w-fileExtV.x/2,
-            .y = h+fileNameV.y,
+    // Video runs at a fixed rate on the wall clock: skip the readback when
+    // no frame is due yet, repeat the frame when rendering fell behind
+    double t0 = wall_time();
+    size_t due = (size_t)((t0 - rec->start) * rec->fps) + 1;
+    if (due <= rec->framesDue) return;
+
+    if (tex.width != rec->w || tex.height != rec->h) return;
+
+    int repeat = (int)(due - rec->framesDue);
+    rec->framesDue = due;
+
+    Image img = LoadImageFromTexture(tex);
+    recorder_push(rec, (Color *)img.data, repeat, false);
+
+    double dt = wall_time() - t0;
+    rec->captureSum += dt;
+    if (dt > rec->captureMax) rec->captureMax = dt;
+}
+
+void recorder_stop(Recorder *rec)
+{
+    pthread_mutex_lock(&rec->lock);
+    rec->quit = true;
+    pthread_cond_signal(&rec->notEmpty);
+    pthread_mutex_unlock(&rec->lock);
+
+    pthread_join(rec->thread, NULL);
+    encoder_close(rec->pipe, rec->encoder);
+
+    double elapsed = wall_time() - rec->start;
+    size_t frames = (rec->pushed > 0) ? rec->pushed : 1;
+
+    printf("INFO: RECORD %zu frames written (%zu captured, %zu dropped) in %.2f s\n",
+        rec->written, rec->pushed, rec->dropped, elapsed);
+    printf("INFO: RECORD Capture %.3f ms avg, %.3f ms max per frame | encoder write %.3f ms avg\n",
+        rec->captureSum * 1000.0 / frames, rec->captureMax * 1000.0, rec->writeSum * 1000.0 / frames);
+
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->notEmpty);
+    pthread_cond_destroy(&rec->notFull);
+    free(rec);
+}
+
+void sceneCache_present(RenderTexture2D cache, int w, int h)
+{
+    // Render textures are stored bottom-up, flip on the way out
+    DrawTextureRec(
+        cache.texture,
+        (Rectangle) {
+            .x = 0,
+            .y = 0,
+            .width = w,
+            .height = -h,
         },
-        fontSize,
-        spacing,
+        (Vector2) { 0, 0 },
         WHITE
     );
 }
@@ -735,20 +3360,481 @@ bool handleFileDrop(bool *isPaused)
         printf("INFO:\t  > %s\n", path);
         
         if (isExtensionValid(GetFileExtension(path))) {
-            tracklist_add(path);
-            success++;
+            if (tracklist_add(path)) success++;
         } else {
             printf("INFO: Invalid file extension %s\n", GetFileExtension(fl.paths[i]));
         }
 
     }
     UnloadDroppedFiles(fl);
-    if (success >= 1 && !IsMusicStreamPlaying(tl->current)) {
+    if (success >= 1 && !tracklist_playing()) {
         *isPaused = false;
-        ResumeMusicStream(tl->current);
+        tracklist_pause(false);
         tracklist_play(tl->count-1);  
     }
    
     if (tl->count <= 0) return false; 
     return true;
 }
+
+void latency_add(Latency_Stats *ls, double now, double lag)
+{
+    if (ls->count == 0 || lag < ls->min) ls->min = lag;
+    if (ls->count == 0 || lag > ls->max) ls->max = lag;
+    if (ls->total == 0 || lag < ls->totalMin) ls->totalMin = lag;
+    if (ls->total == 0 || lag > ls->totalMax) ls->totalMax = lag;
+    ls->sum += lag;
+    ls->count++;
+    ls->totalSum += lag;
+    ls->total++;
+
+    if (now - ls->windowStart >= 1.0) {
+        ls->avg = ls->sum / ls->count;
+        ls->lo = ls->min;
+        ls->hi = ls->max;
+        ls->frames = ls->count;
+        ls->sum = 0.0;
+        ls->count = 0;
+        ls->windowStart = now;
+    }
+}
+
+double latency_displayed(double t, double now)
+{
+    // The frame shows the spectrum interpolated between the two newest
+    // snapshots, so its window ends at the same blend of their newest samples
+    const Spectrum_Snapshot *a = engine_snapshot(engine, 1);
+    const Spectrum_Snapshot *b = engine_snapshot(engine, 0);
+    float alpha = spectrum_alpha(a, b, t);
+
+    return now - (a->heardTime + alpha * (b->heardTime - a->heardTime));
+}
+
+void latency_draw(const Latency_Stats *ls, int h)
+{
+    const char *text = (ls->frames == 0) ? "latency: waiting for playback" :
+        TextFormat("latency %+.1f ms (%+.1f .. %+.1f over %zu frames), output %.1f ms, offset %+.0f ms",
+            1000.0 * ls->avg, 1000.0 * ls->lo, 1000.0 * ls->hi, ls->frames, 1000.0 * engine_output_latency(engine),
+            1000.0 * engine_sync_offset(engine));
+
+    DrawText(text, 10, h - 30, 20, LIGHTGRAY);
+}
+
+void latency_report(const Latency_Stats *ls, const char *what)
+{
+    if (ls->total == 0) return;
+
+    printf("INFO: LATENCY %s %+.1f ms avg, %+.1f min, %+.1f max over %zu frames (output latency %.1f ms)\n",
+        what, 1000.0 * ls->totalSum / ls->total, 1000.0 * ls->totalMin, 1000.0 * ls->totalMax, ls->total,
+        1000.0 * engine_output_latency(engine));
+}
+
+void click_generate(void *bufferData, unsigned int frames)
+{
+    // Sharp attack and a fast exponential decay: broadband enough to light
+    // up the whole spectrum and nothing a resampler would filter out
+    float *out = bufferData;
+
+    for (unsigned int i = 0; i < frames; i++, clickTrack.frame++)
+    {
+        size_t phase = clickTrack.frame % clickTrack.period;
+        float v = (phase < 96) ? 0.9f * expf(-(float)phase / 8.0f) : 0.0f;
+        out[2 * i] = v;
+        out[2 * i + 1] = v;
+    }
+}
+
+void click_tap(void *bufferData, unsigned int frames)
+{
+    double now = wall_time();
+    const float *fs = bufferData;
+
+    fft_callback(bufferData, frames);
+
+    // Same model the engine uses for snapshots, but for the exact sample the
+    // click starts at. The tap runs at the device rate, not the click's.
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        bool loud = fabsf(fs[2 * i]) > 0.5f;
+
+        if (loud && !clickTrack.inClick)
+            atomic_store(&clickTrack.heard, now + engine_output_latency(engine) + (double)i / engine_rate(engine));
+
+        clickTrack.inClick = loud;
+    }
+}
+
+int latency_test(int clicks)
+{
+    InitWindow(1024, 900, "Music Visualizer - latency test");
+
+    int refresh = GetMonitorRefreshRate(GetCurrentMonitor());
+    SetTargetFPS((refresh > 0) ? refresh : 60);
+
+    InitAudioDevice();
+    audioBuff_init(48000, 2);
+
+    // Nothing is looped back from the speakers: when a click is heard comes
+    // from the same output latency model the snapshots use, so this only
+    // checks the tap to screen part of the chain against that model
+    printf("INFO: LATENCY Self-test is model-only, click times come from the output latency model, not a loopback\n");
+
+    clickTrack.rate = 48000;
+    clickTrack.period = clickTrack.rate / 2;
+    AudioStream stream = LoadAudioStream(clickTrack.rate, 32, 2);
+    SetAudioStreamCallback(stream, click_generate);
+    AttachAudioStreamProcessor(stream, click_tap);
+    PlayAudioStream(stream);
+
+    Latency_Stats measured = {0};
+    Latency_Stats model = {0};
+    size_t analyzedGen = 0;
+    float prevLevel = 0.0f;
+    double deadline = wall_time() + 2.0 + 2.0 * clicks * clickTrack.period / clickTrack.rate;
+
+    while (!WindowShouldClose() && (int)measured.total < clicks && wall_time() < deadline)
+    {
+        int w = GetRenderWidth();
+        int h = GetRenderHeight();
+        size_t gen = engine_generation(engine);
+
+        audio_sync();
+
+        if (gen != analyzedGen) {
+            viewPos = engine_playing(engine, wall_time());
+            engine_analyze_at(engine, wall_time(), viewPos);
+            analyzedGen = gen;
+        }
+
+        // Mean of the displayed spectrum: zero in the silence between clicks
+        const Spectrum_Snapshot *b = engine_snapshot(engine, 0);
+        float level = 0.0f;
+        for (size_t i = 0; i < b->bins; i++) level += b->logL[i];
+        if (b->bins > 0) level /= b->bins;
+
+        BeginDrawing();
+            ClearBackground(BLACK);
+            fft_visualize(b, b, 0.0, w, h);
+            DrawText(TextFormat("latency self-test (model only, no loopback): %zu of %d clicks", measured.total, clicks), 10, 10, 20, LIGHTGRAY);
+        EndDrawing();
+
+        double now = wall_time();
+        if (level > 0.05f && prevLevel <= 0.05f) {
+            double heard = atomic_exchange(&clickTrack.heard, 0.0);
+            if (heard > 0.0) {
+                latency_add(&measured, now, now - heard);
+                latency_add(&model, now, now - b->heardTime);
+                printf("INFO: LATENCY click %zu: onset on screen %+.1f ms after it was heard\n", measured.total, 1000.0 * (now - heard));
+            }
+        }
+        prevLevel = level;
+    }
+
+    if ((int)measured.total < clicks)
+        printf("ERROR: Only %zu of %d clicks were detected on screen\n", measured.total, clicks);
+
+    latency_report(&measured, "self-test click to onset (modeled speaker time)");
+    latency_report(&model, "self-test snapshot model, same frames");
+
+    StopAudioStream(stream);
+    UnloadAudioStream(stream);
+    CloseAudioDevice();
+    audioBuff_free();
+    CloseWindow();
+
+    return ((int)measured.total < clicks) ? 1 : 0;
+}
+
+Trace_Writer *trace_start(const char *path, unsigned int sampleRate, unsigned int channels)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        printf("ERROR: Could not create trace %s\n", path);
+        return NULL;
+    }
+
+    Trace_Header hdr = {0};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.sampleRate = sampleRate;
+    hdr.channels = channels;
+    fwrite(&hdr, sizeof(hdr), 1, file);
+
+    Trace_Writer *tw = (Trace_Writer *)malloc(sizeof(Trace_Writer));
+    memset(tw, 0, sizeof(Trace_Writer));
+
+    tw->file = file;
+    tw->channels = channels;
+    tw->start = wall_time();
+    tw->ring = (unsigned char *)malloc(TRACE_RING);
+    atomic_init(&tw->head, 0);
+    atomic_init(&tw->tail, 0);
+    atomic_init(&tw->quit, false);
+
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->wake, NULL);
+    pthread_create(&tw->thread, NULL, trace_writer, tw);
+
+    printf("INFO: TRACE Recording %s (%u Hz, %u channels)\n", path, sampleRate, channels);
+
+    return tw;
+}
+
+void trace_tap(Trace_Writer *tw, const float *fs, unsigned int frames)
+{
+    // Audio thread: never blocks, a buffer that doesn't fit is dropped and
+    // counted in the next block that does
+    size_t bytes = (size_t)frames * tw->channels * sizeof(float);
+    size_t tail = atomic_load_explicit(&tw->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&tw->head, memory_order_acquire);
+
+    if (TRACE_RING - (tail - head) < sizeof(Trace_Block) + bytes) {
+        tw->dropped++;
+        tw->lost++;
+        return;
+    }
+
+    Trace_Block b = {
+        .time = wall_time() - tw->start,
+        .frames = frames,
+        .dropped = tw->lost,
+    };
+
+    const unsigned char *src[2] = { (const unsigned char *)&b, (const unsigned char *)fs };
+    size_t len[2] = { sizeof(b), bytes };
+
+    for (int k = 0; k < 2; k++)
+    {
+        size_t at = tail & (TRACE_RING - 1);
+        size_t first = (len[k] < TRACE_RING - at) ? len[k] : TRACE_RING - at;
+        memcpy(tw->ring + at, src[k], first);
+        memcpy(tw->ring, src[k] + first, len[k] - first);
+        tail += len[k];
+    }
+
+    atomic_store_explicit(&tw->tail, tail, memory_order_release);
+    tw->lost = 0;
+    tw->blocks++;
+    tw->frames += frames;
+}
+
+void *trace_writer(void *arg)
+{
+    // Drains the ring every few milliseconds; the audio thread doesn't
+    // signal, so it never has to touch the lock
+    Trace_Writer *tw = arg;
+
+    pthread_mutex_lock(&tw->lock);
+
+    for (;;)
+    {
+        bool quit = atomic_load(&tw->quit);
+        size_t head = atomic_load_explicit(&tw->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&tw->tail, memory_order_acquire);
+
+        if (head == tail) {
+            // Drain everything queued before honoring quit
+            if (quit) break;
+
+            struct timespec ts;
+            timespec_get(&ts, TIME_UTC);
+            ts.tv_nsec += 5000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&tw->wake, &tw->lock, &ts);
+            continue;
+        }
+
+        size_t at = head & (TRACE_RING - 1);
+        size_t n = (tail - head < TRACE_RING - at) ? tail - head : TRACE_RING - at;
+
+        if (!tw->broken && fwrite(tw->ring + at, 1, n, tw->file) != n) {
+            printf("ERROR: TRACE Could not write the trace file\n");
+            tw->broken = true;
+        }
+
+        atomic_store_explicit(&tw->head, head + n, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&tw->lock);
+
+    return NULL;
+}
+
+void trace_stop(Trace_Writer *tw)
+{
+    // The audio device has to be closed already, nothing may call trace_tap
+    pthread_mutex_lock(&tw->lock);
+    atomic_store(&tw->quit, true);
+    pthread_cond_signal(&tw->wake);
+    pthread_mutex_unlock(&tw->lock);
+
+    pthread_join(tw->thread, NULL);
+
+    // The header was written before the device rate was known
+    uint32_t rate = engine_rate(engine);
+    fseek(tw->file, (long)offsetof(Trace_Header, sampleRate), SEEK_SET);
+    fwrite(&rate, sizeof(rate), 1, tw->file);
+    fclose(tw->file);
+
+    printf("INFO: TRACE %zu buffers (%zu frames, %.2f s) recorded, %zu dropped\n",
+        tw->blocks, tw->frames, wall_time() - tw->start, tw->dropped);
+
+    pthread_mutex_destroy(&tw->lock);
+    pthread_cond_destroy(&tw->wake);
+    free(tw->ring);
+    free(tw);
+}
+
+int trace_replay(const char *path, const char *prefix, size_t view)
+{
+    // Read up front, so the disk doesn't show up in the timings
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("ERROR: Could not open trace %s\n", path);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char *data = (size > 0) ? (unsigned char *)malloc(size) : NULL;
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+        printf("ERROR: Could not read trace %s\n", path);
+        fclose(file);
+        free(data);
+        return 1;
+    }
+    fclose(file);
+
+    Trace_Header hdr = {0};
+    if ((size_t)size >= sizeof(hdr))
+        memcpy(&hdr, data, sizeof(hdr));
+
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != TRACE_VERSION || hdr.sampleRate == 0 || hdr.channels == 0 || hdr.channels > TAP_MAX_CHANNELS) {
+        printf("ERROR: %s is not a usable tap trace\n", path);
+        free(data);
+        return 1;
+    }
+
+    audioBuff_init(hdr.sampleRate, hdr.channels);
+
+    bool showWave;
+    bool showFFT;
+    bool showFFT2;
+    bool showSpectro;
+    view_select(view, &showWave, &showFFT, &showFFT2, &showSpectro);
+
+    int w = 1024;
+    int h = 900;
+    engine_set_bands(engine, w);
+    Soft_Canvas *sc = soft_create(w, h, true);
+    vis->trailSoft = soft_create(w, h, true);
+    memset(vis->trailSoft->px, 0, (size_t)w * h * sizeof(Color));
+
+    Image img = {
+        .data = sc->px,
+        .width = w,
+        .height = h,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+
+    size_t at = sizeof(hdr);
+    size_t blocks = 0;
+    size_t lost = 0;
+    size_t frame = 0;
+    double tick = 0.0;
+    double audio = 0.0;
+    double pushSum = 0.0;
+    double analyzeSum = 0.0;
+    double analyzeMax = 0.0;
+    double renderSum = 0.0;
+    double renderMax = 0.0;
+    uint64_t checksum = 14695981039346656037ULL;
+
+    while (at + sizeof(Trace_Block) <= (size_t)size)
+    {
+        Trace_Block b;
+        memcpy(&b, data + at, sizeof(b));
+
+        size_t bytes = (size_t)b.frames * hdr.channels * sizeof(float);
+        if ((size_t)size - at - sizeof(b) < bytes) {
+            printf("ERROR: Trace %s is cut off in buffer %zu\n", path, blocks);
+            break;
+        }
+
+        const float *fs = (const float *)(data + at + sizeof(b));
+        at += sizeof(b) + bytes;
+        blocks++;
+        lost += b.dropped;
+        audio += (double)b.frames / hdr.sampleRate;
+
+        double c0 = wall_time();
+        engine_push(engine, fs, b.frames);
+        pushSum += wall_time() - c0;
+
+        // Analyze on the live loop's ANALYSIS_HZ schedule, in recorded time.
+        // Without a playing-now estimate offline the window simply ends at
+        // the newest sample.
+        if (b.time < tick) continue;
+        while (tick <= b.time) tick += 1.0 / ANALYSIS_HZ;
+
+        size_t pos = engine_position(engine);
+        viewPos = (pos > N / 2) ? pos - N / 2 : 0;
+
+        double a0 = wall_time();
+        engine_analyze_at(engine, b.time, viewPos);
+
+        if (showFFT2)
+            trail_update(engine_snapshot(engine, 1), engine_snapshot(engine, 0), b.time, w, h);
+        if (showSpectro)
+            spectro_update(engine_snapshot(engine, 0));
+        double a1 = wall_time();
+
+        soft_begin(sc, BLACK);
+        drawScene(b.time, w, h, showWave, showFFT, showFFT2, showSpectro, false);
+        soft_flush(sc);
+        double r1 = wall_time();
+
+        analyzeSum += a1 - a0;
+        renderSum += r1 - a1;
+        if (a1 - a0 > analyzeMax) analyzeMax = a1 - a0;
+        if (r1 - a1 > renderMax) renderMax = r1 - a1;
+
+        // FNV-1a over the spectrum bits, to tell output changes apart from
+        // timing changes
+        const Spectrum_Snapshot *s = engine_snapshot(engine, 0);
+        for (size_t i = 0; i < s->bins; i++)
+        {
+            uint32_t l, r;
+            memcpy(&l, &s->logL[i], sizeof(l));
+            memcpy(&r, &s->logR[i], sizeof(r));
+            checksum = (checksum ^ l) * 1099511628211ULL;
+            checksum = (checksum ^ r) * 1099511628211ULL;
+        }
+
+        if (prefix != NULL)
+            ExportImage(img, TextFormat("%s%05zu.png", prefix, frame));
+
+        frame++;
+    }
+
+    size_t frames = (frame > 0) ? frame : 1;
+    printf("INFO: REPLAY %zu buffers, %.2f s of audio (%zu lost while recording)\n", blocks, audio, lost);
+    printf("INFO: REPLAY Push %.3f ms per buffer | analysis %.3f ms avg, %.3f ms max | render %.3f ms avg, %.3f ms max (%zu frames)\n",
+        pushSum * 1000.0 / ((blocks > 0) ? blocks : 1), analyzeSum * 1000.0 / frames, analyzeMax * 1000.0,
+        renderSum * 1000.0 / frames, renderMax * 1000.0, frame);
+    printf("INFO: REPLAY Spectrum checksum %016llx\n", (unsigned long long)checksum);
+
+    soft_free(sc);
+    soft_free(vis->trailSoft);
+    vis->trailSoft = NULL;
+    free(data);
+    audioBuff_free();
+
+    return 0;
+}